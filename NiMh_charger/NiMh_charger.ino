@@ -55,11 +55,27 @@ void setup(void) {
     for (uint8_t i = 0; i < 2; ++i) {
         bool no_discharge = rec.bit_flag[i] & bf_nodischarge;
         batt[i].init(rec.capacity[i], rec.type[i], rec.loops[i], no_discharge);
+        for (uint8_t b = 0; b < PID_BANDS; ++b) {
+            if (rec.Kp[i][b] && rec.Ki[i][b]) {             // The PID coefficients of the current band were tuned
+                core.changePID(i, 1, rec.Kp[i][b], b);
+                core.changePID(i, 2, rec.Ki[i][b], b);
+            }
+        }
+    }
+    tCal    cal;
+    core.cfg.readCalibration(cal);                          // The nominal calibration if never calibrated by NiMh_serial
+    for (uint8_t i = 0; i < 2; ++i) {
+        core.calibrate(i, cal.offset[i][0], cal.offset[i][1],
+            cal.gain[i][CAL_VOLTAGE], cal.gain[i][CAL_CHARGE], cal.gain[i][CAL_DISCHARGE]);
     }
 
     core.dspl.aboutInfo(core.temperature(2));
     core.fan(true);
-    delay(3000);
+    uint32_t fan_test = millis() + 3000;
+    while (millis() < fan_test) {                           // Show the heat sink temperature as soon as it has been measured
+        if (core.updateTemperature())
+            core.dspl.aboutInfo(core.temperature(2));
+    }
     core.fan(false);
     core.dspl.clear();
 }
@@ -68,17 +84,51 @@ void loop(void) {
     static uint32_t next[2] = {0};                          // Next phase loop ms
     static time_t   over[2] = {0};
     static time_t   log_time = 0;
+    static uint8_t  tuned    = 0;                           // Bitmap of the slots interrupted by PID autotune
 
+    core.control();                                         // Manage the charging current
+    core.updateVoltage();                                   // Measure the battery voltage of the charging channels
+    if (core.quietWindow()) {                               // Keep the LCD, the serial & the sensors bus silent while sampling the voltage
+        core.sleepIdle();
+        return;
+    }
     core.manageFan();                                       // Prevent main heat sink overheating
     core.dspl.updateBrightness();                           // Smoothly manage display brightness
         
     for (uint8_t i = 0; i < 2; ++i) {
+        uint8_t event = core.slotEvent(i);
+        if (event == SLOT_REMOVED) {                        // The battery removed, the slot was switched off by the control step
+            logSlot(i, false);
+            logSettling(i, &core);
+            core.resetSettling(i);
+            disconnectBattery(i);
+            over[i] = phase[0]->init(i, &core, &batt[i]);
+            if (over[i] > 0) over[i] += now();
+            next[i] = 0;                                    // Wait for the next battery at once
+        } else if (event == SLOT_INSERTED) {
+            logSlot(i, true);
+            next[i] = 0;
+        }
         if (millis() < next[i]) continue;
+        if (core.autotuneActive(i)) {                       // The slot is busy by PID autotune started from setup menu
+            tuned  |= 1 << i;
+            next[i] = millis() + 1000;
+            continue;
+        }
+        if (tuned & (1 << i)) {                             // The autotune is over and the channel stopped, restart the phase
+            tuned  &= ~(1 << i);
+            over[i] = phase[batt[i].phaseIndex()]->init(i, &core, &batt[i]);
+            if (over[i] > 0) over[i] += now();
+            next[i] = millis() + 1000;
+            continue;
+        }
         uint8_t phase_index = batt[i].phaseIndex();
         PHASE* p = phase[phase_index];
         if (phase_index == 5 && core.mV(i) < BATT_DETECT_VOLTAGE
                 && batt[i].averageCurrent() < BATT_DETECT_CURRENT) {
             // Disconnected battery after charged
+            logSettling(i, &core);
+            core.resetSettling(i);
             disconnectBattery(i);                           // Initialize battery slot with parameters from EEPROM
             p = phase[0];
             over[i] = p->init(i, &core, &batt[i]);
@@ -87,6 +137,8 @@ void loop(void) {
             return;
         } else if (phase_index >= 1 && batt[i].averageVoltage() < BATT_DETECT_VOLTAGE 
                 && batt[i].averageCurrent() < BATT_DETECT_CURRENT) { // disconnected battery while charging
+            logSettling(i, &core);
+            core.resetSettling(i);
             disconnectBattery(i);                           // Initialize battery slot with parameters from EEPROM
             p = phase[0];
             over[i] = p->init(i, &core, &batt[i]);
@@ -102,9 +154,14 @@ void loop(void) {
             over[i] = 0;
         }
         if (next_ms == 0) {                                 // The phase finished
+            logSettling(i, &core);
+            core.resetSettling(i);
+            logOutliers(i, &batt[i]);
+            batt[i].resetOutliers();
+            bool full = (phase_index == PH_POSTCHARGE);     // The charge loop discharges the battery charged in full
             phase_index = batt[i].nextPhase(false);         // Activate next charging phase
             if (phase_index == PH_DISCHARGE) {
-                core.initDischargeCounter(i);
+                core.initDischargeCounter(i, full);
                 core.initChargeCounter(i);
             } else if (phase_index == PH_PRECHARGE) {
                 core.initChargeCounter(i);
@@ -143,24 +200,31 @@ void loop(void) {
             int16_t t = core.temperature(i);
             logBatteryStatus(i, &batt[i], &core, t);
         }
+        logControl(core.controlWCET(), core.controlOverruns());
     }
 }
 
+/*
+ * Called by delay() while waiting.
+ * Perform the requested charging current control steps when the main loop is busy
+ */
+void yield(void) {
+    core.control();
+}
+
 /*
  * The TIM1 overflow interrupt handler.
- * Called 500 times per second
- * Used to manage the charging current via PID controller
+ * Called PWM_FREQUENCY (500) times per second
+ * Requests the charging current control step that is performed by PID controller in the main loop
  */
 static volatile uint16_t counter = 0;
 ISR(TIMER1_OVF_vect) {
-    if (++counter > 500/4) {                                // 4 times per second. End of period, manage channel "A"
+    core.ditherPWM();                                       // Sigma-delta PWM duty of the low current channels
+    core.pulseTick();                                       // The discharge pulses
+    if (++counter >= CONTROL_PERIOD) {                      // CONTROL_RATE times per second. End of period, manage channel "A"
         counter = 0;
-        TIMSK1 &= ~_BV(TOIE1);                              // disable the overflow interrupts
-        core.keepCurrent(0);
-        TIMSK1 |= _BV(TOIE1);                               // enable the the overflow interrupts
-    } else if (counter == 500/8) {                          // Half of period, manage channel "B"
-        TIMSK1 &= ~_BV(TOIE1);                              // disable the overflow interrupts
-        core.keepCurrent(1);
-        TIMSK1 |= _BV(TOIE1);                               // enable the the overflow interrupts
+        core.controlTick(0);
+    } else if (counter == CONTROL_PERIOD/2) {               // Half of period, manage channel "B"
+        core.controlTick(1);
     }
 }
@@ -35,13 +35,42 @@ bool BATTERY::voltageDrop(void) {
     mV.dump();
 #endif
     if (!volt_incr) {
-        if (g > 4) {
+        if (g > (4 << TWCH_MV_FRAC)) {
             volt_incr = true;                               // voltage increment detected!
             logMessage(F("Voltage increment detected"));
         }
         return false; 
     }
-    return (g < -10);
+    return (g < -(10 << TWCH_MV_FRAC));
+}
+
+/*
+ * The fast charged battery temperature rises quickly when the battery becomes full: the charging energy turns to heat.
+ * The temperature is sampled by the charging phase step, but not more often than every DTDT_PERIOD seconds.
+ * The slope of the history line is the rise rate per sample, it is converted to the rate per minute
+ * by the actual sampling period: the time between the first and the latest samples of the charge.
+ * The check starts DTDT_HOLDOFF seconds after the charging phase started (not the precharge),
+ * when the initial warming of the battery has settled.
+ */
+void BATTERY::updateTemperature(int16_t t) {
+    time_t n = now();
+    if (n < temp_next) return;
+    temp_next = n + DTDT_PERIOD;
+    temp.update((t > 0)?t:0);
+    if (temp_samples++ == 0)
+        temp_first = n;
+    temp_last = n;
+}
+
+int16_t BATTERY::temperatureSlope(void) {
+    if (temp_samples < 2 || temp_last <= temp_first) return 0;
+    int32_t g = temp.gradient();                            // 1/1000 Celsius per sample
+    return g * 6 * (int32_t)(temp_samples - 1) / (int32_t)(temp_last - temp_first);
+}
+
+bool BATTERY::temperatureRise(void) {
+    if (temp.length() < B_TEMP_SIZE || now() < charge_start + DTDT_HOLDOFF) return false;
+    return temperatureSlope() >= DTDT_RISE;
 }
 
 uint16_t BATTERY::chargeCurrent(void) {
@@ -55,9 +84,18 @@ uint16_t BATTERY::chargeCurrent(void) {
     } else if (charge_type == CH_SLOW) {
         current = mAh / 10;
         finish  = now () + 39600;                           // 11*3600;
-    } else {
-        current = mAh / 4;
-        finish  = now () + 18000;                           // 5*3600;
+    } else if (charge_type == CH_REFLEX) {
+        current = mAh / 2;
+        if (current > REFLEX_MAX_CURRENT)
+            current = REFLEX_MAX_CURRENT;
+        uint32_t h = mAh / current + 2;
+        finish = now() + h*3600;
+    } else {                                                // Fast charging is completed by dT/dt or -dV
+        current = mAh / 2;
+        if (current > FAST_MAX_CURRENT)
+            current = FAST_MAX_CURRENT;
+        uint32_t h = mAh / current + 1;
+        finish = now() + h*3600;
     }
     return current;
 }
@@ -95,7 +133,9 @@ tPhase BATTERY::phaseID(void) {
     if (phase_index < 3) {                                  // No charge yet
         return (tPhase)phase_index;
     } else if (phase_index == 3) {                          // Charging
-        uint8_t t = phase_index + (uint8_t)charge_type;
+        uint8_t ct = (uint8_t)charge_type;
+        if (charge_type == CH_REFLEX) ct = (uint8_t)CH_FAST; // Reflex charging shares the fast charging symbol: no more LCD custom characters
+        uint8_t t = phase_index + ct;
         return (tPhase)t;
     } else {
         return (tPhase)(phase_index + 2);
@@ -105,6 +145,12 @@ tPhase BATTERY::phaseID(void) {
 void BATTERY::startCharging(void) {
     overheat    = false;
     volt_incr   = false;                                    // Voltage increment flag reset at phase start
+    mV_filter.reset();                                      // The charging current changed, do not reject the new level
+    mA_filter.reset();
+    temp.reset();
+    temp_next   = 0;
+    temp_samples = 0;
+    charge_start = now();
     // Truncate history data
     uint16_t tmp = mV.read();
     mV.reset();
@@ -133,6 +179,12 @@ uint8_t BATTERY::phaseError(bool reset_error) {
 void BATTERY::reset(void) {
     mV.reset();
     mA.reset();
+    temp.reset();
+    temp_next   = 0;
+    temp_samples = 0;
+    mV_filter.reset();
+    mA_filter.reset();
+    resetOutliers();
 }
 
 void  BATTERY::finishCode(tFinish code) {
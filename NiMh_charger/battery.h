@@ -9,21 +9,29 @@
 
 #define B_MV_SIZE    (16)
 #define B_MA_SIZE    (4)
+#define B_TEMP_SIZE  (8)                                    // The temperature history length, one charging step (at least DTDT_PERIOD seconds) apart
+#define B_FILTER     (5)                                    // The spike rejecting filter window
 
 class BATTERY {
     public:
-        BATTERY(void) : mV(B_MV_SIZE), mA(B_MA_SIZE)        { }
+        BATTERY(void) : mV_filter(B_MV_SPIKE << TWCH_MV_FRAC), mA_filter(B_MA_SPIKE) { }
         void        init(uint16_t mAh, tChargeType type, uint8_t loops, bool no_discharge);
         tChargeType schedule(void)                          { return charge_type; }
         uint8_t     phaseIndex(void)                        { return phase_index; }
         void        setPhaseIndex(uint8_t phase)            { phase_index = phase; }
         uint16_t    averageCurrent(void)                    { return mA.read(); }
-        uint16_t    averageVoltage(void)                    { return mV.read(); }
+        uint16_t    averageVoltage(void)                    { return toMilliVolts(mV.read()); }
         uint16_t    capacity(void)                          { return mAh; }
         bool        togglePause(void)                       { pause = !pause; return pause; }
         void        setPause(bool pause)                    { this->pause = pause; }
-        uint16_t    update(uint16_t mV)                     { return this->mV.average(mV); }
-        uint16_t    updateCurrent(uint16_t mA)              { return this->mA.average(mA); }
+        uint16_t    update(uint16_t mV)                     { return updateFine(mV << TWCH_MV_FRAC); }
+        uint16_t    updateFine(uint16_t fine_mV)            { return toMilliVolts(mV.average(mV_filter.filter(fine_mV))); }
+        uint16_t    updateCurrent(uint16_t mA)              { return this->mA.average(mA_filter.filter(mA)); }
+        void        restartVoltage(uint16_t mV)             { this->mV.reset(); mV_filter.reset(); update(mV); }
+        uint16_t    fineVoltage(void)                       { return mV.read(); } // Average voltage, mV with TWCH_MV_FRAC fractional bits
+        uint16_t    voltageOutliers(void)                   { return mV_filter.outliers(); }
+        uint16_t    currentOutliers(void)                   { return mA_filter.outliers(); }
+        void        resetOutliers(void)                     { mV_filter.resetOutliers(); mA_filter.resetOutliers(); }
         time_t      elapsed(void)                           { if (start) return now() - start; return 0; }
         bool        prechargeCurrent(void)                  { return c_reg; }
         void        setPrechargeCurrent(void)               { c_reg = true; }
@@ -41,12 +49,19 @@ class BATTERY {
         time_t      remains(void);
         uint16_t    chargeCurrent(void);
         bool        voltageDrop(void);
+        void        updateTemperature(int16_t t);           // Sample the battery temperature, not more often than every DTDT_PERIOD seconds
+        int16_t     temperatureSlope(void);                 // The battery temperature rise rate, 1/100 Celsius per minute
+        bool        temperatureRise(void);
         uint8_t     nextPhase(bool fin);                    // fin flag indicating the charging finished
         tPhase      phaseID(void);
         void        startCharging(void);
     private:
-        HISTORY     mV;                                     // The battery voltage history data
-        HISTORY     mA;                                     // The battery current history data
+        uint16_t    toMilliVolts(uint16_t fine_mV)          { return (fine_mV + (1 << (TWCH_MV_FRAC-1))) >> TWCH_MV_FRAC; }
+        HISTORY<B_MV_SIZE> mV;                              // The battery voltage history data, mV with TWCH_MV_FRAC fractional bits
+        HISTORY<B_MA_SIZE> mA;                              // The battery current history data
+        HISTORY<B_TEMP_SIZE> temp;                          // The battery temperature history data, 1/10 Celsius
+        HAMPEL<B_FILTER>   mV_filter;                       // The battery voltage spike filter
+        HAMPEL<B_FILTER>   mA_filter;                       // The battery current spike filter
         uint16_t    mAh         = BATT_CAPACITY;            // The batterry capacity
         uint8_t     phase_index = 0;                        // Charging phase index
         tChargeType charge_type = CH_SLOW;                  // Charging type
@@ -55,6 +70,11 @@ class BATTERY {
         uint16_t    max_temp    = 0;                        // The maximum possible battery temperature
         time_t      finish      = 0;                        // Time when battery scheduler should be finished
         time_t      start       = 0;                        // Time when charging started
+        time_t      charge_start = 0;                       // Time when the current charging phase started, see startCharging()
+        time_t      temp_next   = 0;                        // Time when the battery temperature should be sampled
+        time_t      temp_first  = 0;                        // Time of the first battery temperature sample of the charge
+        time_t      temp_last   = 0;                        // Time of the latest battery temperature sample
+        uint16_t    temp_samples = 0;                       // The number of the battery temperature samples of the charge
         bool        pause       = false;                    // Flag of current phase
         bool        c_reg       = false;                    // The charging current registered
         bool        overheat    = false;                    // The battery overheats while charging
@@ -0,0 +1,22 @@
+#ifndef _BENCH_ARDUINO_H_
+#define _BENCH_ARDUINO_H_
+/*
+ * The minimal host replacement of the Arduino core for the statistics benchmark (see stat_bench.cpp).
+ * Only the types and the Serial calls used by stat.h are provided.
+ */
+#include <stdint.h>
+#include <stdio.h>
+
+class __FlashStringHelper;
+#define F(s)    (reinterpret_cast<const __FlashStringHelper *>(s))
+
+class HostSerial {
+    public:
+        void    print(const __FlashStringHelper *s)         { fputs(reinterpret_cast<const char *>(s), stdout); }
+        void    print(const char *s)                        { fputs(s, stdout); }
+        void    print(long v)                               { printf("%ld", v); }
+        void    println(long v)                             { printf("%ld\n", v); }
+};
+static HostSerial Serial;
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * Host benchmark and cross-check of the battery history gradient.
+ * The Arduino IDE does not compile this folder. Build and run it on the host from NiMh_charger/bench:
+ *      g++ -O2 -std=c++11 -I. -I.. stat_bench.cpp ../stat.cpp -o stat_bench && ./stat_bench
+ *
+ * The firmware calls HISTORY::update() and HISTORY::gradient() on every CHARGE step
+ * (BATTERY::voltageDrop() and BATTERY::temperatureSlope()), so this path is measured:
+ *  - loop:   the original per-call loop over the ring buffer, 32-bit sums centered on the mean
+ *  - int64:  the running sums with the 64-bit slope
+ *  - int32:  the running sums with the centered 32-bit slope, statSlope()
+ * The slopes are checked to be equal first. The host timing shows the relative cost only:
+ * the host CPU divides 64-bit numbers in hardware, the AVR calls the library routines for them.
+ *
+ * The firmware has no dispersion any more, nothing used it. The float dispersion of the original HISTORY
+ * is compared with the integer variance of the exact running sums it was replaced with first:
+ *  - float:  the loop over the ring buffer, the squared deviations from the rounded mean, float division
+ *  - int:    (N * sum(Y^2) - sum(Y)^2) / N^2 of the running sums, 4 fractional bits, 64-bit arithmetic
+ */
+#include <chrono>
+#include <stdlib.h>
+#include "Arduino.h"
+#include "stat.h"
+
+#define BENCH_SIZE      (16)                                // B_MV_SIZE
+#define BENCH_CALLS     (5000000UL)
+
+// The original gradient: the loop over the ring buffer, the values centered on the rounded mean
+class LOOP_HISTORY {
+    public:
+        void        update(uint16_t item) {
+            if (len < BENCH_SIZE) {
+                queue[len++] = item;
+            } else {
+                queue[index] = item;
+                if (++index >= BENCH_SIZE) index = 0;
+            }
+        }
+        int32_t     gradient(void) {
+            if (len < 3) return 0;
+            uint32_t s = 0;
+            for (uint8_t i = 0; i < len; ++i) s += queue[i];
+            uint16_t avg = (s + len/2) / len;
+            int32_t sx = 0, sxx = 0, sxy = 0, sy = 0;
+            uint8_t item = index;
+            for (uint8_t i = 1; i <= len; ++i) {
+                int32_t value = (int32_t)queue[item] - (int32_t)avg;
+                sx  += i;
+                sxx += i*i;
+                sxy += i*value;
+                sy  += value;
+                if (++item >= BENCH_SIZE) item = 0;
+            }
+            int32_t numerator   = len * sxy - sx * sy;
+            int32_t denominator = len * sxx - sx * sx;
+            return numerator*100/denominator;
+        }
+    private:
+        uint16_t    queue[BENCH_SIZE];
+        uint8_t     len     = 0;
+        uint8_t     index   = 0;
+};
+
+// The 64-bit slope of the running sums
+static int32_t slope64(uint64_t sxy, uint32_t sy, uint16_t n) {
+    if (n < 2) return 0;
+    int64_t nn  = n;
+    int64_t sx  = nn * (nn + 1) / 2;
+    int64_t sxx = nn * (nn + 1) * (2 * nn + 1) / 6;
+    int64_t numerator   = nn * (int64_t)sxy - sx * (int64_t)sy;
+    int64_t denominator = nn * sxx - sx * sx;
+    return (int32_t)(numerator*100/denominator);
+}
+
+// Compare statSlope() with the 64-bit slope on random sums of n entries, up to the longest HISTORY allowed
+static bool crossCheck(void) {
+    for (uint32_t t = 0; t < 2000000UL; ++t) {
+        uint8_t  n   = 2 + rand() % 127;
+        uint16_t top = (t & 1)?65535:(1 + rand() % 65535);
+        uint32_t sy = 0, sxy = 0;
+        bool     up = rand() & 1;
+        for (uint8_t i = 1; i <= n; ++i) {
+            uint16_t y = (t % 3 == 0)?(up?(uint32_t)top*i/n:(uint32_t)top*(n-i)/n):(rand() % (top + 1UL));
+            sy  += y;
+            sxy += (uint32_t)i * y;
+        }
+        if (statSlope(sxy, sy, n) != slope64(sxy, sy, n)) {
+            printf("mismatch: n = %d, sxy = %u, sy = %u\n", n, sxy, sy);
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename H>
+static double timeGradient(H &h, const uint16_t *data, int32_t &sink) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < BENCH_CALLS; ++i) {
+        h.update(data[i & 1023]);
+        sink += h.gradient();
+    }
+    std::chrono::duration<double, std::nano> d = std::chrono::steady_clock::now() - start;
+    return d.count() / BENCH_CALLS;
+}
+
+// HISTORY with the 64-bit slope of the same running sums
+class INT64_HISTORY {
+    public:
+        void        update(uint16_t item) {
+            if (len < BENCH_SIZE) {
+                queue[(index + len) % BENCH_SIZE] = item;
+                ++len;
+                sxy += (uint32_t)len * item;
+            } else {
+                uint16_t oldest = queue[index];
+                queue[index] = item;
+                index = (index + 1) % BENCH_SIZE;
+                sxy -= sy;
+                sy  -= oldest;
+                sxy += (uint32_t)len * item;
+            }
+            sy += item;
+        }
+        int32_t     gradient(void)                          { return (len < 3)?0:slope64(sxy, sy, len); }
+    private:
+        uint16_t    queue[BENCH_SIZE];
+        uint8_t     len     = 0;
+        uint8_t     index   = 0;
+        uint32_t    sy      = 0;
+        uint32_t    sxy     = 0;
+};
+
+// The original dispersion: the loop over the ring buffer and the float division
+class FLOAT_HISTORY {
+    public:
+        void        update(uint16_t item) {
+            if (len < BENCH_SIZE) {
+                queue[len++] = item;
+            } else {
+                queue[index] = item;
+                if (++index >= BENCH_SIZE) index = 0;
+            }
+        }
+        float       dispersion(void) {
+            if (len < 3) return 1000;
+            uint32_t s = 0;
+            for (uint8_t i = 0; i < len; ++i) s += queue[i];
+            long avg = (s + len/2) / len;
+            long sum = 0;
+            for (uint8_t i = 0; i < len; ++i) {
+                long q = queue[i];
+                q -= avg;
+                q *= q;
+                sum += q;
+            }
+            sum += len << 1;
+            return (float)sum / (float)len;
+        }
+    private:
+        uint16_t    queue[BENCH_SIZE];
+        uint8_t     len     = 0;
+        uint8_t     index   = 0;
+};
+
+// The integer variance of the running sums, 4 fractional bits
+class INT_VAR_HISTORY {
+    public:
+        void        update(uint16_t item) {
+            if (len < BENCH_SIZE) {
+                queue[(index + len) % BENCH_SIZE] = item;
+                ++len;
+            } else {
+                uint16_t oldest = queue[index];
+                queue[index] = item;
+                index = (index + 1) % BENCH_SIZE;
+                sy  -= oldest;
+                syy -= (uint32_t)oldest * oldest;
+            }
+            sy  += item;
+            syy += (uint32_t)item * item;
+        }
+        uint32_t    dispersion(void) {
+            if (len < 3) return 1000UL << 4;
+            uint64_t n2 = (uint64_t)len * len;
+            uint64_t s  = (uint64_t)len * syy - (uint64_t)sy * sy;
+            s <<= 4;
+            s  += n2 >> 1;
+            return s / n2;
+        }
+    private:
+        uint16_t    queue[BENCH_SIZE];
+        uint8_t     len     = 0;
+        uint8_t     index   = 0;
+        uint32_t    sy      = 0;
+        uint64_t    syy     = 0;
+};
+
+template <typename H>
+static double timeDispersion(H &h, const uint16_t *data, double &sink) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < BENCH_CALLS; ++i) {
+        h.update(data[i & 1023]);
+        sink += h.dispersion();
+    }
+    std::chrono::duration<double, std::nano> d = std::chrono::steady_clock::now() - start;
+    return d.count() / BENCH_CALLS;
+}
+
+int main(void) {
+    srand(1);
+    if (!crossCheck()) return 1;
+    printf("statSlope() matches the 64-bit slope\n");
+
+    uint16_t data[1024];
+    for (uint16_t i = 0; i < 1024; ++i)
+        data[i] = 22000 + i + rand() % 64;                  // 1.37 V rising, TWCH_MV_FRAC fine mV with noise
+    LOOP_HISTORY        h_loop;
+    INT64_HISTORY       h_int64;
+    HISTORY<BENCH_SIZE> h_int32;
+    int32_t sink = 0;
+    double t_loop  = timeGradient(h_loop,  data, sink);
+    double t_int64 = timeGradient(h_int64, data, sink);
+    double t_int32 = timeGradient(h_int32, data, sink);
+    printf("update() + gradient(), HISTORY of %d, ns per call: loop %.1f, int64 %.1f, int32 %.1f (%d)\n",
+            BENCH_SIZE, t_loop, t_int64, t_int32, (int)(sink & 1));
+
+    FLOAT_HISTORY       h_float;
+    INT_VAR_HISTORY     h_int;
+    double d_sink = 0;
+    double t_float = timeDispersion(h_float, data, d_sink);
+    double t_int   = timeDispersion(h_int,   data, d_sink);
+    printf("update() + dispersion(), HISTORY of %d, ns per call: float %.1f, int %.1f (%d)\n",
+            BENCH_SIZE, t_float, t_int, (int)d_sink & 1);
+    return 0;
+}
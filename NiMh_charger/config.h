@@ -5,6 +5,10 @@
 
 // Aref voltage (setup by voltage source), mV
 #define AREF_MV         (2487)
+// The fractional bits of the fine (oversampled) battery voltage, mV
+#define TWCH_MV_FRAC    (4)
+// The unity gain of the ADC calibration, the gain has 15 fractional bits
+#define CAL_GAIN_ONE    (32768U)
 
 // The LCD I2C interface address
 #define LCD_I2C_ADDR    (0x27)
@@ -42,12 +46,24 @@
 #define LOG_STATUS_PERIOD   (600)
 
 
+// The charging current control loop rate, Hz (50-100). TIMER1 (500 Hz) period should be a multiple of the control period
+#define CONTROL_RATE        (50)
+// The number of the charging current bands with own PID coefficients (keep & precharge, slow charge, fast charge)
+#define PID_BANDS           (3)
+// The charging current below this value (mA) is driven by PWM with sigma-delta dithering
+#define PWM_DITHER_CURRENT  (64)
+
 // Charge resistors resistance, 1/10 Ohms. i.e. 31 for 3.1 Ohm
 #define TWCH_CHARGE_RES_A   (30)
 #define TWCH_CHARGE_RES_B   (31)
 // Discharge resistors resistance, 1/10 Ohms
 #define TWCH_DISCH_RES_A    (11)
 #define TWCH_DISCH_RES_B    (10)
+// The charging current that makes AREF_MV on the charge resistor: the ADC full scale of the channel, mA
+#define TWCH_FULL_SCALE_A   (AREF_MV * 10L / TWCH_CHARGE_RES_A)
+#define TWCH_FULL_SCALE_B   (AREF_MV * 10L / TWCH_CHARGE_RES_B)
+// The maximum charging current, mA. 90% of the lower full scale leaves room for the ripple and the PID overshoot
+#define TWCH_MAX_CURRENT    (((TWCH_FULL_SCALE_A < TWCH_FULL_SCALE_B)?TWCH_FULL_SCALE_A:TWCH_FULL_SCALE_B) * 9 / 10)
 
 // Default battery capacity. Just for reference. Actual capacity can be adjusted through menu setup
 #define BATT_CAPACITY           (2000)
@@ -85,8 +101,34 @@
 #define PRECHARGE_CURRENT       (30)
 #define KEEP_CURRENT            (10)
 
+// The minimal deviation from the median of the voltage (mV) and current (mA) readings to be rejected as a spike
+#define B_MV_SPIKE              (30)
+#define B_MA_SPIKE              (20)
+
 // Discharging impulse time, ms
 #define DISCHARGING_PULSE       (20)
+// Reflex charging pulse train: charge pulse, discharge (burp) pulse and rest time, ms
+#define REFLEX_CHARGE_PULSE     (1000)
+#define REFLEX_BURP_PULSE       (6)
+#define REFLEX_REST_TIME        (20)
+// Maximum reflex charging current, mA
+#define REFLEX_MAX_CURRENT      (700)
+// Maximum fast charging current, mA
+#define FAST_MAX_CURRENT        (700)
+
+// Temperature slope (dT/dt) termination of the fast charging: the shortest battery temperature sampling period
+// (the temperature is sampled by the charging step) and the charging time before the slope is checked, seconds
+#define DTDT_PERIOD             (30)
+#define DTDT_HOLDOFF            (600)
+// The battery temperature rise rate that completes fast charging, 1/100 Celsius per minute
+#define DTDT_RISE               (80)
+
+#if REFLEX_MAX_CURRENT > TWCH_MAX_CURRENT
+#error "REFLEX_MAX_CURRENT is out of the measurable charging current range"
+#endif
+#if FAST_MAX_CURRENT > TWCH_MAX_CURRENT
+#error "FAST_MAX_CURRENT is out of the measurable charging current range"
+#endif
 
 // Heat sink temperature to turn on the FAN
 #define HS_HOT_TEMP             (500)
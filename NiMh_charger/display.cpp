@@ -104,10 +104,13 @@ static const char M_name[8][12] PROGMEM = {
     "Complete   "
 };
 
-static const char types[3][7] PROGMEM = {
+static const char reflex_name[12] PROGMEM = "Reflex chrg"; // Replaces the fast charge phase name of reflex charging
+
+static const char types[4][7] PROGMEM = {
     "Slow  ",
     "Rest. ",
-    "Fast  "
+    "Fast  ",
+    "Reflex"
 };
 
 static const char F_code[5][12] PROGMEM = {
@@ -184,9 +187,12 @@ void DSPL::phaseName(tPhase phase, uint8_t index, uint16_t cap, tChargeType type
     }
     write(phase);
     write(' ');
+    const char *name = M_name[(uint8_t)phase];
+    if (type == CH_REFLEX && phase == (tPhase)(PH_CHARGE + CH_FAST))
+        name = reflex_name;
     uint8_t c = 0;
     for ( ; c < 16; ++c) {
-        char sym = pgm_read_byte(&M_name[(uint8_t)phase][c]);
+        char sym = pgm_read_byte(&name[c]);
         if (sym ==0) break;
         write(sym);
     }
@@ -256,6 +262,33 @@ void DSPL::timeInfo(tPhase phase, uint8_t index, time_t elapsed, time_t remains,
     print(F(")"));
 }
 
+/*
+ * The (dis)charged energy in Wh with one decimal, up to 65.5 Wh.
+ * The efficiency is known when the charge loop discharged the battery charged in full (see TWCHARGER::coulombEfficiency()),
+ * i.e. in the loop mode only. Otherwise the field is left blank.
+ */
+void DSPL::energyInfo(tPhase phase, uint8_t index, uint16_t mWh, uint8_t c_eff, uint8_t e_eff, uint16_t mV, uint16_t mA) {
+    if (ROWS > 2) {
+        setCursor(0, index*ROWS/2+1);
+        write(' ');
+        drawChargeInfo(mV, mA);
+        setCursor(0, index*ROWS/2);
+    } else {
+        setCursor(0, index);
+    }
+    write(phase);
+    uint16_t dWh = ((uint32_t)mWh + 50) / 100;              // 1/10 Wh, rounded
+    sprintf(buff, " %2u.%1u Wh  ", dWh/10, dWh%10);
+    print(buff);
+    if (c_eff > 0 && e_eff > 0) {                           // The discharge is paired with the preceding full charge
+        sprintf(buff, "%3u%%%3u%%", c_eff, e_eff);
+        print(buff);
+        fillRow(19);
+    } else {
+        fillRow(11);
+    }
+}
+
 void  DSPL::aboutInfo(uint16_t temp) {
     setCursor(0, 0);
     print(F("NiMh chrgr "));
@@ -308,11 +341,12 @@ void DSPL::setupMode(uint8_t index, uint8_t menu, uint16_t value) {
             break;
         case 2:
             print(F("Charge "));
-            if (value < 3) {
+            if (value <= (uint8_t)CH_REFLEX) {
                 for (uint8_t c = 0 ; c < 6; ++c) {
                     char sym = pgm_read_byte(&types[value][c]);
                     write(sym);
                 }
+                if (value == (uint8_t)CH_REFLEX) value = (uint8_t)CH_FAST; // The same LCD symbol as fast charging
                 write(value+3);
             }
             break;
@@ -326,6 +360,23 @@ void DSPL::setupMode(uint8_t index, uint8_t menu, uint16_t value) {
             print(F("discharge"));
             break;
         case 5:
+            print(F("PID autotune"));
+            if (value == TUNE_SETTLE || value == TUNE_RELAY)
+                print(F(" ..."));
+            else if (value == TUNE_DONE)
+                print(F(" done"));
+            else if (value == TUNE_FAIL)
+                print(F(" fail"));
+            break;
+        case 7:
+            print(F("Tune: no idle batt"));
+            break;
+        case 8:
+            print(F("Tune by "));
+            print(value);
+            print(F(" mA"));
+            break;
+        case 6:
             print(F("Back"));
         default:
             break;
@@ -20,6 +20,7 @@ class DSPL : public LiquidCrystal_I2C {
         void        chargingInfo(tPhase phase, uint8_t index, uint16_t mV, uint16_t mA, uint16_t charged, uint16_t temp);
         void        tempInfo(tPhase phase, uint8_t index, uint16_t charged, uint16_t temp, uint16_t mV, uint16_t mA);
         void        timeInfo(tPhase phase, uint8_t index, time_t elapsed, time_t remains, uint16_t mV, uint16_t mA);
+        void        energyInfo(tPhase phase, uint8_t index, uint16_t mWh, uint8_t c_eff, uint8_t e_eff, uint16_t mV, uint16_t mA);
         void        aboutInfo(uint16_t temp);
         void        slotMenu(uint8_t slot);
 		void		setupMode(uint8_t index, uint8_t mode, uint16_t value);
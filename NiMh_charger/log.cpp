@@ -70,9 +70,23 @@ void logBatteryStatus(uint8_t index, BATTERY *b, HW *core, int16_t temp) {
     Serial.print(b->averageCurrent());
     Serial.print(F(" mA, dis-charged "));
     Serial.print(core->discharged(index));
-    Serial.print(F(" mAh, charged "));
+    Serial.print(F(" mAh "));
+    Serial.print(core->dischargedMWh(index));
+    Serial.print(F(" mWh, charged "));
     Serial.print(core->charged(index));
-    Serial.print(F(" mAh, temp. "));
+    Serial.print(F(" mAh "));
+    Serial.print(core->chargedMWh(index));
+    Serial.print(F(" mWh, "));
+    uint8_t c_eff = core->coulombEfficiency(index);
+    uint8_t e_eff = core->energyEfficiency(index);
+    if (c_eff && e_eff) {                                   // The discharge of the battery charged in full is completed
+        Serial.print(F("efficiency "));
+        Serial.print(c_eff);
+        Serial.print(F("% ("));
+        Serial.print(e_eff);
+        Serial.print(F("% energy), "));
+    }
+    Serial.print(F("temp. "));
     Serial.print(temp/10);
     Serial.print(".");
     Serial.println(temp%10);
@@ -95,6 +109,89 @@ void logFan(int16_t hs_temp, bool on) {
 #endif
 }
 
+void logControl(uint16_t wcet, uint16_t overruns) {
+#ifdef LOG_ENABLE
+    logTimestamp();
+    Serial.print(F("control step WCET "));
+    Serial.print(wcet);
+    Serial.print(F(" us, overruns "));
+    Serial.println(overruns);
+#endif
+}
+
+void logSettling(uint8_t index, HW *core) {
+#ifdef LOG_ENABLE
+    index &= 1;                                             // Ensure index is in interval 0..1
+    logTimestamp();
+    Serial.print((char)(index+'A'));
+    Serial.print(F(" current settling time "));
+    Serial.print(core->settleTime(index));
+    Serial.print(F(" ms, max "));
+    Serial.print(core->settleMax(index));
+    Serial.print(F(" ms, unsettled "));
+    Serial.print(core->unsettled(index));
+    Serial.print(F(", recovery time "));
+    Serial.print(core->recoverTime(index));
+    Serial.print(F(" ms, max "));
+    Serial.print(core->recoverMax(index));
+    Serial.println(F(" ms"));
+#endif
+}
+
+void logOutliers(uint8_t index, BATTERY *b) {
+#ifdef LOG_ENABLE
+    uint16_t v = b->voltageOutliers();
+    uint16_t c = b->currentOutliers();
+    if (v == 0 && c == 0) return;                           // Nothing to report
+    index &= 1;                                             // Ensure index is in interval 0..1
+    logTimestamp();
+    Serial.print((char)(index+'A'));
+    Serial.print(F(" rejected spikes: voltage "));
+    Serial.print(v);
+    Serial.print(F(", current "));
+    Serial.println(c);
+#endif
+}
+
+void logDetection(uint8_t index, uint16_t ms) {
+#ifdef LOG_ENABLE
+    index &= 1;                                             // Ensure index is in interval 0..1
+    logTimestamp();
+    Serial.print((char)(index+'A'));
+    Serial.print(F(" battery detected in "));
+    Serial.print(ms);
+    Serial.println(F(" ms"));
+#endif
+}
+
+void logSlot(uint8_t index, bool inserted) {
+#ifdef LOG_ENABLE
+    index &= 1;                                             // Ensure index is in interval 0..1
+    logTimestamp();
+    Serial.print((char)(index+'A'));
+    if (inserted)
+        Serial.println(F(" battery inserted"));
+    else
+        Serial.println(F(" battery removed"));
+#endif
+}
+
+void logAutotune(uint8_t index, bool ok, int Kp, int Ki) {
+#ifdef LOG_ENABLE
+    index &= 1;                                             // Ensure index is in interval 0..1
+    logTimestamp();
+    Serial.print((char)(index+'A'));
+    if (!ok) {
+        Serial.println(F(" PID autotune failed"));
+        return;
+    }
+    Serial.print(F(" PID autotune Kp = "));
+    Serial.print(Kp);
+    Serial.print(F(", Ki = "));
+    Serial.println(Ki);
+#endif
+}
+
 void logComplete(uint8_t index, __FlashStringHelper *msg) {
 #ifdef LOG_ENABLE
     index &= 1;                                             // Ensure index is in interval 0..1
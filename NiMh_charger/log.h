@@ -11,6 +11,12 @@ void logMessage(__FlashStringHelper *msg);
 void logPhase(uint8_t index, uint8_t phase, bool lf = true);
 void logBatteryStatus(uint8_t index, BATTERY *b, HW *core, int16_t temp);
 void logFan(int16_t hs_temp, bool on);
+void logControl(uint16_t wcet, uint16_t overruns);
+void logSettling(uint8_t index, HW *core);
+void logOutliers(uint8_t index, BATTERY *b);
+void logDetection(uint8_t index, uint16_t ms);
+void logSlot(uint8_t index, bool inserted);
+void logAutotune(uint8_t index, bool ok, int Kp, int Ki);
 void logComplete(uint8_t index, __FlashStringHelper *msg);
 void logComplete(uint8_t index, const char *msg);
 
@@ -1,5 +1,6 @@
 #include "mode.h"
 #include "cfg.h"
+#include "log.h"
 
 //---------------------- The Menu mode -------------------------------------------
 MODE* MODE::returnToMain(void) {
@@ -65,6 +66,7 @@ MODE* MAIN::loop(BATTERY b[2]) {
         // 2 - Charging info
         // 3 - Temperature info
         // 4 - Charge elapced / remaining time 
+        // 5 - (Dis)charged energy and efficiency (blank unless the charge loop paired the discharge with the full charge)
         uint8_t d_mode = dspl_mode;
         if (phase == PH_CHECK) {
             if (d_mode > 2) d_mode = 2;                     // Show voltage and current
@@ -76,11 +78,14 @@ MODE* MAIN::loop(BATTERY b[2]) {
             if (real > mV) mV = real;                       // Average voltage has not been setup yet
         }
         uint16_t charged = 0;
+        uint16_t mWh     = 0;
         if (phase == PH_DISCHARGE) {
             charged = pCore->discharged(i);
-            if (d_mode > 3) d_mode = 3;
+            mWh     = pCore->dischargedMWh(i);
+            if (d_mode == 4) d_mode = 3;                    // No charging times while discharging
         } else {
             charged = pCore->charged(i);
+            mWh     = pCore->chargedMWh(i);
         }
         switch (d_mode) {
             case 0:                                         // About + self temperature
@@ -107,6 +112,9 @@ MODE* MAIN::loop(BATTERY b[2]) {
             case 4:                                         // Charging times
                 pD->timeInfo(phase, i, b[i].elapsed(), b[i].remains(), mV, mA);
                 break;
+            case 5:                                         // (Dis)charged Wh, round-trip efficiency in the loop mode
+                pD->energyInfo(phase, i, mWh, pCore->coulombEfficiency(i), pCore->energyEfficiency(i), mV, mA);
+                break;
             default:
                 break;
         }
@@ -115,7 +123,7 @@ MODE* MAIN::loop(BATTERY b[2]) {
     }                                                       // End of battery loop
     if (millis() > change_mode) {
         change_mode = millis() + mode_period;
-        if (++dspl_mode > 4) {
+        if (++dspl_mode > 5) {
             dspl_mode = 0;
             reset_display = true;
         }
@@ -138,6 +146,7 @@ void SETUP::init(BATTERY b[2]) {
     pCore->dspl.backlight(true);
     pCore->dspl.clear();
     slot    = 2;                                            // The battery slot should be selected first
+    tuning  = 2;
     pCore->encoder.reset(0, 0, 1, 1, 1, true);              // Encoder interval [0; 1] - select battery slot
     update_screen   = 0;
     setTimeout(30);                                         // Automatically return in 30 seconds timeout
@@ -150,11 +159,12 @@ MODE* SETUP::loop(BATTERY b[2]) {
 
     uint8_t bs = pCore->encoder.buttonCheck();  
     if (bs == 1) {                                          // short button press
+        refused = false;
         if (slot == 2) {                                    // The batery slot just selected
             slot = pCore->encoder.read();                   // Setup slot number to edit
             entity = 0;
             old_encoder = 1;
-            pE->reset(1, 1, 5, 1, 1, true);                 // Prepare to select edit entity
+            pE->reset(1, 1, 6, 1, 1, true);                 // Prepare to select edit entity
         } else {
             if (entity == 0) {                              // The entity index to be edited just selected
                 entity = pE->read();                        // Setup entity to edit
@@ -168,7 +178,7 @@ MODE* SETUP::loop(BATTERY b[2]) {
                         break;
                     case 2:                                 // Prepare to edit charging type
                         old_encoder = cfg.type[slot];
-                        pE->reset(old_encoder, 0, 2, 1, 1, true);
+                        pE->reset(old_encoder, 0, (uint8_t)CH_REFLEX, 1, 1, true);
                         break;
                     case 3:                                 // Prepare to edit charging loops number
                         old_encoder = cfg.loops[slot];
@@ -178,6 +188,17 @@ MODE* SETUP::loop(BATTERY b[2]) {
                         cfg.bit_flag[slot] ^= bf_nodischarge;
                         entity = 0;                         // Edit in place
                         break;
+                    case 5:                                 // Prepare to select the PID autotune current, 0.1C by default
+                        if (tuning == 2 && tunable(slot, b)) {
+                            old_encoder = cfg.capacity[slot] / 10;
+                            old_encoder -= old_encoder % 10;
+                            old_encoder = constrain(old_encoder, 10, TWCH_MAX_CURRENT);
+                            pE->reset(old_encoder, 10, TWCH_MAX_CURRENT, 10, 50, false);
+                        } else {
+                            refused = true;                 // Show the reason in place
+                            entity  = 0;
+                        }
+                        break;
                     default:                                // Return to battery select menu
                         old_encoder = 0;
                         pCore->encoder.reset(0, 0, 1, 1, 1, true);
@@ -197,10 +218,16 @@ MODE* SETUP::loop(BATTERY b[2]) {
                     case 3:                                 // charging loops
                         cfg.loops[slot] = pE->read();
                         break;
+                    case 5:                                 // Start PID autotune by the selected current, it selects the PID band
+                        if (tuning == 2 && tunable(slot, b) && pCore->startAutotune(slot, pE->read()))
+                            tuning = slot;
+                        else
+                            refused = true;
+                        break;
                     default:
                         break;
                 }
-                pE->reset(1, 1, 5, 1, 1, true);             // Prepare to select edit entity
+                pE->reset((entity == 5)?5:1, 1, 6, 1, 1, true); // Prepare to select edit entity, show the autotune status
                 entity = 0;
             }
         }
@@ -224,6 +251,23 @@ MODE* SETUP::loop(BATTERY b[2]) {
         return this;
     }
 
+    if (tuning < 2) {                                       // PID autotune in progress
+        uint8_t status = pCore->autotuneStatus(tuning);
+        if (status == TUNE_DONE || status == TUNE_FAIL) {
+            int Kp = pCore->changePID(tuning, 1, -1);
+            int Ki = pCore->changePID(tuning, 2, -1);
+            if (status == TUNE_DONE) {                      // The coefficients will be saved with the configuration
+                uint8_t band = pCore->pidBand(tuning);      // The current band of the autotune
+                cfg.Kp[tuning][band] = Kp;
+                cfg.Ki[tuning][band] = Ki;
+            }
+            logAutotune(tuning, status == TUNE_DONE, Kp, Ki);
+            tuning = 2;
+            update_screen = 0;
+        }
+        resetTimeout();                                     // Do not return to main mode while tuning
+    }
+
     uint16_t e = pE->read();
     if (e != old_encoder) {
         old_encoder     = e;
@@ -251,6 +295,10 @@ MODE* SETUP::loop(BATTERY b[2]) {
                 case 4:                                     // nodischarge bit
                     v = cfg.bit_flag[slot];
                     break;
+                case 5:                                     // PID autotune status
+                    v = pCore->autotuneStatus(slot);
+                    if (refused) e = 7;                     // The autotune cannot be started
+                    break;
                 default:
                     break;
             }
@@ -260,8 +308,22 @@ MODE* SETUP::loop(BATTERY b[2]) {
                 e -= e % 100;
                 e = constrain(e, 100, 5000);
             }
-            pD->setupMode(slot, entity, e);
+            if (entity == 5)                                // The PID autotune current
+                pD->setupMode(slot, 8, e);
+            else
+                pD->setupMode(slot, entity, e);
         }
     }
     return returnToMain();
 }
+
+/*
+ * The PID autotune charges the battery by the selected current, so the slot should hold a battery
+ * and should not be (dis)charging: the battery just checked or completely charged.
+ * The main loop restarts the slot phase when the autotune is over.
+ */
+bool SETUP::tunable(uint8_t index, BATTERY b[2]) {
+    uint8_t phase_index = b[index].phaseIndex();
+    if (phase_index != (uint8_t)PH_CHECK && phase_index != (uint8_t)PH_KEEP) return false;
+    return pCore->mV(index) > BATT_DETECT_VOLTAGE;
+}
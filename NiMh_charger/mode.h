@@ -44,6 +44,7 @@ class MAIN : public MODE {
  *  1   - voltage, current
  *  2   - charging or discharging current, temperature
  *  3   - charging times: elapced, remain
+ *  4   - (dis)charged energy, mAh & mWh efficiency of the session
  */
 
 //---------------------- The Setup mode ------------------------------------------
@@ -55,7 +56,10 @@ class SETUP : public MODE {
     private:
         tCfg            cfg;                                // The configuration record
         uint8_t         slot    = 2;                        // The battery index: 0, 1; 2 means select slot number
-        uint8_t         entity  = 0;                        // The entity to edit 0 - unselected, 1 - capacity, 2 - type, 3 - loops, 4 - back
+        uint8_t         entity  = 0;                        // The entity to edit 0 - unselected, 1 - capacity, 2 - type, 3 - loops, 4 - discharge, 5 - autotune, 6 - back
+        bool            tunable(uint8_t index, BATTERY b[2]);
+        uint8_t         tuning  = 2;                        // The slot being autotuned, 2 if none
+        bool            refused = false;                    // The PID autotune cannot be started on the slot
         const uint32_t  period  = 5000;
 };
 
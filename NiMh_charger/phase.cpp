@@ -2,45 +2,24 @@
 #include "config.h"
 #include "log.h"
 
+time_t CHECK::init(uint8_t index, TWCHARGER *pCharger, BATTERY *b) {
+    pCharger->startDetect(index);
+    return 0;
+}
+
 /*
  * Check battery phase.
- * Check the slot voltage and try to charge and check the current
+ * The battery detection is managed by the charger state machine (see TWCHARGER::detect()):
+ * check the slot voltage, try to discharge the battery and check the current, then try to charge
+ * and check the current. The phase only polls the state machine.
  */
 uint32_t CHECK::run(uint8_t index, TWCHARGER *pCharger, BATTERY *b) {
-    uint32_t next = millis() + period;
-    if (!b->phaseComplete()) {                              // No minumum voltage detected yet
-        int16_t mV  = pCharger->mV(index);
-        int16_t avg = b->update(mV);
-        if (mV > BATT_DETECT_VOLTAGE) {                     // Perhaps, the battery is connected
-            if (abs(mV - avg) > 30)                         // Synchronize battery voltage
-                return 500;
-            b->setPhaseComplete(true);                      // Set flag indicating the minimum battery voltage detected on this slot
-            pCharger->discharge(index, true);               // Start discharging the battery and try to detect current through it
-        }
-    } else {                                                // Minimum battery voltage detected on the slot
-        uint8_t iteration = b->phaseError(false);
-        if (iteration < 3) {                                // PhaseError increments error counter and returns it
-            // First 3 iterations after minimum voltage has been detected
-            if (pCharger->mA(index) >= MIN_DISCHARGE_CURRENT) { // The battery detected in the slot
-                pCharger->discharge(index, false);          // Stop discharging the battery
-                return 0;                                   // Finish this phase
-            }
-            return 100;
-        } else if (iteration < 23) {                        // No current from battery detected, try to apply chagring current
-            if (iteration == 3)
-                pCharger->discharge(index, false);
-            // Apply BATT_DETECT_POWER to the battery and check current is greater than BATT_DETECT_CURRENT
-            if (pCharger->isBatteryConnected(index, iteration-3)) { // The charging current detected
-                return 0;
-            }
-            return 200;
-        } else {                                            // No battery detected
-            b->setPhaseComplete(false);                     // Clear flag indicating the minimal voltage detected
-            b->phaseError(true);                            // Clear iteration counter
-            return 2000;
-        }
+    if (pCharger->detect(index) == DETECT_FOUND) {          // The battery detected in the slot
+        b->restartVoltage(pCharger->mV(index));             // Start the battery voltage history from the detected voltage
+        logDetection(index, pCharger->detectTime(index));
+        return 0;                                           // Finish this phase
     }
-    return next;
+    return millis() + period;
 }
 
 time_t DISCHARGE::init(uint8_t index, TWCHARGER *pCharger, BATTERY *b) {
@@ -157,6 +136,8 @@ time_t CHARGE::init(uint8_t index, TWCHARGER *pCharger, BATTERY *b) {
     time_t finish_time = now() + b->remains();
     b->startCharging();
     pCharger->setChargeCurrent(index, b->chargeCurrent());
+    if (type == CH_REFLEX)                                  // Charge, burp & rest pulses are generated by the charger
+        pCharger->pulseTrain(index, REFLEX_CHARGE_PULSE, REFLEX_BURP_PULSE, REFLEX_REST_TIME);
     b->setPause(false);
     return finish_time;
 }
@@ -164,13 +145,13 @@ time_t CHARGE::init(uint8_t index, TWCHARGER *pCharger, BATTERY *b) {
 uint32_t CHARGE::run(uint8_t index, TWCHARGER *pCharger, BATTERY *b) {
     uint32_t next_step   = millis() + period;
     tChargeType type = b->schedule();
-    if (type != CH_FAST)
+    if (type != CH_FAST && type != CH_REFLEX)
         pCharger->pulseDischarge(index, DISCHARGING_PULSE); // Apply discharging impulse
-    uint16_t mV = pCharger->mV(index);                      // Read cached voltage value sometimes update this cache
+    uint16_t mV = b->updateFine(pCharger->fineMV(index));   // Oversampled voltage keeps the small -dV gradient
     uint16_t mA = pCharger->mA(index);
     uint16_t t = pCharger->temperature(index);
-    mV = b->update(mV);
     b->updateCurrent(mA);
+    b->updateTemperature(t);
 
     uint16_t max_temp = b->getMaxTemp();
     if (max_temp > 0 && t >= max_temp) {
@@ -191,6 +172,14 @@ uint32_t CHARGE::run(uint8_t index, TWCHARGER *pCharger, BATTERY *b) {
         return 0;
     }
     
+    if ((type == CH_FAST || type == CH_REFLEX) && b->temperatureRise()) { // The full battery heats up, stop charging
+        b->finishCode(CODE_OK);
+        char buff[24];
+        int16_t slope = b->temperatureSlope();
+        sprintf(buff, "Temp. rise %d.%02d/min", slope/100, slope%100);
+        logComplete(index, buff);
+        return 0;
+    }
     if (type != CH_RESTORE && b->voltageDrop()) {           // The battery voltage drop has been detected, stop charging
         b->finishCode(CODE_OK);
         logComplete(index, F("Voltage drop"));
@@ -237,16 +226,14 @@ uint32_t POSTCHARGE::run(uint8_t index, TWCHARGER *pCharger, BATTERY *b) {
     uint16_t t  = pCharger->temperature(index);
 
     if (b->phaseComplete()) {
-        pCharger->pulseDischarge(index, DISCHARGING_PULSE); // Apply discharging pulse
-        uint16_t mV = pCharger->mV(index);
+        uint16_t mV = pCharger->mV(index);                  // The voltage after the discharging pulse and the pause
         b->update(mV);
         if (mV > BATT_POSTCHARGE_VOLTAGE) return 0;         // Post charging complete
         b->setPhaseComplete(false);
     }
     bool charge = b->togglePause();
     if (charge) {
-        pCharger->pulseDischarge(index, DISCHARGING_PULSE); // Apply discharging pulse
-        uint16_t mV = pCharger->mV(index);
+        uint16_t mV = pCharger->mV(index);                  // The voltage after the discharging pulse and the pause
         b->update(mV);
         if (mV > BATT_POSTCHARGE_VOLTAGE) {                 // Near complete
             b->setPhaseComplete(true);
@@ -260,6 +247,8 @@ uint32_t POSTCHARGE::run(uint8_t index, TWCHARGER *pCharger, BATTERY *b) {
     }
     if (t > MAX_TEMPERATURE) return 0;                      // The battery has been overheated
     if (b->voltageDrop())    return 0;                      // The battery voltage drop has been detected, stop charging
+    if (!charge)                                            // Apply discharging pulse before the pause, the next step reads the voltage
+        pCharger->pulseDischarge(index, DISCHARGING_PULSE);
     pCharger->pauseCharging(index, !charge);
     return next_step;
 }
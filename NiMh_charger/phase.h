@@ -17,9 +17,10 @@ class PHASE {
 class CHECK: public PHASE {
     public:
         CHECK(void)                                         { }
+        virtual time_t      init(uint8_t index, TWCHARGER *pCharger, BATTERY *b);
         virtual uint32_t    run(uint8_t index, TWCHARGER *pCharger, BATTERY *b);
     private:
-        const uint32_t period = 5000;
+        const uint32_t period = 20;
 };
 
 class DISCHARGE: public PHASE {
@@ -0,0 +1,230 @@
+#include "sampler.h"
+
+static SAMPLER * smpl = 0;
+
+// ADC conversion complete interrupt handler
+ISR(ADC_vect) {
+    if (smpl) smpl->conversionComplete();
+}
+
+void SAMPLER::init(uint8_t sync_a, uint8_t sync_b) {
+    for (uint8_t ch = 0; ch < SMPL_CHANNELS; ++ch) {
+        for (uint8_t i = 0; i < SMPL_RING; ++i)
+            ring[ch][i] = 0;
+        summ[ch]    = 0;
+        len[ch]     = 0;
+        index[ch]   = 0;
+    }
+    int8_t ch = channel(sync_a);
+    sync_ch[0]  = (ch < 0)?0:ch;
+    ch = channel(sync_b);
+    sync_ch[1]  = (ch < 0)?0:ch;
+    for (uint8_t i = 0; i < 2; ++i) {
+        sync_acc[i]     = 0;
+        sync_cnt[i]     = 0;
+        sync_last[i]    = 0;
+    }
+    smpl = this;
+    uint8_t sreg = SREG;
+    cli();
+    active      = 0;
+    acc         = 0;
+    count       = 0;
+    drop        = true;
+    burst       = 0;
+    sync_next   = 0;
+    sync_conv   = true;
+    ADMUX   = sync_ch[0];                                   // External AREF, right adjusted result, the first synchronized channel
+    ADCSRB  = _BV(ADTS2) | _BV(ADTS1);                      // Auto trigger source is TIMER1 overflow
+    DIDR0   = 0b00001111;                                   // Disable digital input buffers on A0-A3
+    ADCSRA  = _BV(ADEN) | _BV(ADIE) | _BV(ADATE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0); // Enable ADC, its interrupt & auto trigger, prescale = 128
+    SREG    = sreg;
+}
+
+int8_t SAMPLER::channel(uint8_t pin) {
+    if (pin >= A0) pin -= A0;
+    if (pin >= SMPL_CHANNELS) return -1;
+    return pin;
+}
+
+int8_t SAMPLER::syncIndex(uint8_t pin) {
+    int8_t ch = channel(pin);
+    if (ch < 0) return -1;
+    if (sync_ch[0] == ch) return 0;
+    if (sync_ch[1] == ch) return 1;
+    return -1;
+}
+
+void SAMPLER::restart(uint8_t pin) {
+    int8_t ch = channel(pin);
+    if (ch < 0) return;
+    uint8_t sreg = SREG;
+    cli();
+    for (uint8_t i = 0; i < SMPL_RING; ++i)
+        ring[ch][i] = 0;
+    summ[ch]    = 0;
+    len[ch]     = 0;
+    index[ch]   = 0;
+    if (active == ch) {                                     // The conversion in progress can be started before restart
+        acc     = 0;
+        count   = 0;
+        drop    = true;
+    }
+    SREG = sreg;
+}
+
+bool SAMPLER::ready(uint8_t pin) {
+    int8_t ch = channel(pin);
+    if (ch < 0) return false;
+    return len[ch] > 0;
+}
+
+uint16_t SAMPLER::read(uint8_t pin) {
+    int8_t ch = channel(pin);
+    if (ch < 0) return 0;
+    uint8_t sreg = SREG;
+    cli();                                                  // Make sure the data are consistent
+    uint16_t s = summ[ch];
+    uint8_t  l = len[ch];
+    SREG = sreg;
+    if (l == 0) return 0;
+    if (l == SMPL_RING)                                     // The ring buffer is full, divide by the constant
+        return (s + SMPL_RING/2) / SMPL_RING;
+    return (s + l/2) / l;
+}
+
+uint32_t SAMPLER::milliVolts(uint8_t pin, uint8_t frac_bits) {
+    return toMilliVolts(read(pin), frac_bits);
+}
+
+/*
+ * Every 4 times more conversions averaged give one more bit: 10 + log4(conversions)
+ */
+uint8_t SAMPLER::resolution(uint8_t pin) {
+    int8_t ch = channel(pin);
+    if (ch < 0) return 0;
+    uint16_t n = len[ch] * SMPL_OVERSAMPLE;
+    uint8_t bits = SMPL_ADC_BITS;
+    for ( ; n >= 4; n >>= 2) ++bits;
+    return bits;
+}
+
+uint16_t SAMPLER::latest(uint8_t pin) {
+    int8_t ch = channel(pin);
+    if (ch < 0) return 0;
+    uint8_t sreg = SREG;
+    cli();
+    uint8_t  i = index[ch];
+    uint8_t  l = len[ch];
+    i = (i == 0)?(SMPL_RING-1):(i-1);                       // The index points to the next reading position
+    uint16_t r = ring[ch][i];
+    SREG = sreg;
+    if (l == 0) return 0;
+    return r;
+}
+
+uint32_t SAMPLER::latestMilliVolts(uint8_t pin) {
+    return toMilliVolts(latest(pin));
+}
+
+/*
+ * The average of synchronized conversions accumulated since the previous call.
+ * Returns the previous value if no conversion has been accumulated.
+ */
+uint16_t SAMPLER::sync(uint8_t pin) {
+    int8_t i = syncIndex(pin);
+    if (i < 0) return 0;
+    uint8_t sreg = SREG;
+    cli();
+    uint32_t a = sync_acc[i];
+    uint16_t c = sync_cnt[i];
+    sync_acc[i] = 0;
+    sync_cnt[i] = 0;
+    SREG = sreg;
+    if (c > 0) {
+        a *= SMPL_OVERSAMPLE;
+        sync_last[i] = (a + c/2) / c;
+    }
+    return sync_last[i];
+}
+
+/*
+ * Drop the synchronized conversions accumulated since the previous sync() call,
+ * e.g. made while the load was off. The next sync() returns the fresh conversions only,
+ * or the previous value if there are none yet.
+ */
+void SAMPLER::syncRestart(uint8_t pin) {
+    int8_t i = syncIndex(pin);
+    if (i < 0) return;
+    uint8_t sreg = SREG;
+    cli();
+    sync_acc[i] = 0;
+    sync_cnt[i] = 0;
+    SREG = sreg;
+}
+
+uint32_t SAMPLER::syncMilliVolts(uint8_t pin) {
+    return toMilliVolts(sync(pin));
+}
+
+uint32_t SAMPLER::toMilliVolts(uint16_t reading, uint8_t frac_bits) {
+    uint32_t v = reading;
+    v *= AREF_MV;
+    v <<= frac_bits;                                        // 16368 * 2487 * 2^6 still fits 32 bits
+    v += (1023UL*SMPL_OVERSAMPLE)/2;                        // Round the result
+    v /= 1023UL*SMPL_OVERSAMPLE;
+    return v;
+}
+
+/*
+ * Called from ADC interrupt handler
+ * The synchronized conversion (triggered by TIMER1) is added to the pin accumulator, then the background burst starts.
+ * The background conversion is accumulated, the reading is saved to the ring buffer when enough conversions accumulated,
+ * and the next background channel is selected. When the burst is over, select the next synchronized channel
+ * and wait for the TIMER1 trigger. Otherwise start the next background conversion.
+ */
+void SAMPLER::conversionComplete(void) {
+    uint16_t v = ADC;
+    if (sync_conv) {                                        // The conversion triggered by TIMER1
+        uint8_t i = sync_next;
+        sync_acc[i] += v;
+        if (++sync_cnt[i] == 0) {                           // Too many conversions without read, restart accumulating
+            sync_acc[i] = v;
+            sync_cnt[i] = 1;
+        }
+        sync_next  ^= 1;
+        sync_conv   = false;
+        burst       = SMPL_BURST;
+        drop        = true;
+        ADMUX       = active;                               // External AREF, switch to the background channel
+        ADCSRA     |= _BV(ADSC);                            // Start the background burst
+        return;
+    }
+    if (drop) {                                             // The first conversion after the channel switch
+        drop = false;
+    } else {
+        acc += v;
+        if (++count >= SMPL_OVERSAMPLE) {                   // The reading is ready
+            uint8_t ch  = active;
+            uint8_t i   = index[ch];
+            summ[ch]   += acc;
+            summ[ch]   -= ring[ch][i];                      // Ring buffer element is zero till the buffer loaded
+            ring[ch][i] = acc;
+            if (++i >= SMPL_RING) i = 0;
+            index[ch]   = i;
+            if (len[ch] < SMPL_RING) ++len[ch];
+            acc     = 0;
+            count   = 0;
+            drop    = true;
+            if (++active >= SMPL_CHANNELS) active = 0;
+            ADMUX   = active;                               // External AREF, switch to the next channel
+        }
+    }
+    if (--burst == 0) {                                     // The burst is over, wait for TIMER1 trigger
+        sync_conv   = true;
+        drop        = true;                                 // The background channel will be switched back after the synchronized conversion
+        ADMUX       = sync_ch[sync_next];
+        return;
+    }
+    ADCSRA |= _BV(ADSC);                                    // Start the next background conversion
+}
@@ -0,0 +1,69 @@
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+#include <Arduino.h>
+#include "config.h"
+
+#define SMPL_CHANNELS   (4)                                 // Analog pins A0-A3 are sampled in background
+#define SMPL_OVERSAMPLE (16)                                // ADC conversions summarized into one reading
+#define SMPL_RING       (4)                                 // The number of readings kept per analog pin
+#define SMPL_BURST      (6)                                 // Background conversions between two synchronized ones
+#define SMPL_ADC_BITS   (10)                                // The ADC resolution
+
+/*
+ * Background ADC sampler.
+ * The ADC conversion is auto-triggered by TIMER1 overflow, i.e. at the same point of every PWM period
+ * (BOTTOM, the middle of the PWM pulse). The triggered conversions sample two synchronized pins
+ * (the charging current pins) in turn and feed the per-pin accumulators. Because all these conversions
+ * are made at the same PWM phase, they do not carry the PWM ripple.
+ * After the synchronized conversion, the ADC conversion complete interrupt starts a burst of SMPL_BURST
+ * background conversions cycling through the analog pins A0-A3, and then switches back to the next
+ * synchronized pin to wait for the next trigger. SMPL_BURST conversions (208 us each with prescale 128)
+ * are well completed inside 2 ms PWM period.
+ * SMPL_OVERSAMPLE background conversions of the same pin are summarized into one reading,
+ * the latest SMPL_RING readings of every pin are kept in the ring buffer.
+ * The ring buffer summ is maintained by the interrupt handler, so the filtered value
+ * can be read in constant time.
+ * The ADC noise (about 1 step) dithers the conversions, so averaging 4^k conversions adds k bits of resolution:
+ * the full ring buffer (SMPL_RING*SMPL_OVERSAMPLE = 64 conversions) gives the 13-bit reading.
+ * The decimated reading is returned in fixed point mV by milliVolts(pin, frac_bits), see resolution().
+ * The first background conversion after the analog channel switched is dropped.
+ * The TIMER1 overflow interrupt must be enabled: its handler clears the overflow flag making the next trigger edge.
+ */
+class SAMPLER {
+    public:
+        SAMPLER(void)                                       { }
+        void        init(uint8_t sync_a, uint8_t sync_b);   // Initialize the sampler with two synchronized pins
+        void        restart(uint8_t pin);                   // Drop the readings of the pin, start to collect the fresh ones
+        bool        ready(uint8_t pin);                     // At least one fresh reading of the pin is available
+        bool        full(uint8_t pin)                       { int8_t ch = channel(pin); return ch >= 0 && len[ch] >= SMPL_RING; }
+        uint8_t     resolution(uint8_t pin);                // The effective resolution of read(pin), bits
+        uint16_t    read(uint8_t pin);                      // Average reading of the pin, 1/SMPL_OVERSAMPLE of ADC step
+        uint32_t    milliVolts(uint8_t pin, uint8_t frac_bits = 0); // Average voltage on the pin, mV with frac_bits fractional bits (up to 6)
+        uint16_t    latest(uint8_t pin);                    // The latest reading of the pin, 1/SMPL_OVERSAMPLE of ADC step
+        uint32_t    latestMilliVolts(uint8_t pin);          // The latest voltage on the pin, mV
+        uint16_t    sync(uint8_t pin);                      // Average synchronized reading since the previous call, 1/SMPL_OVERSAMPLE of ADC step
+        void        syncRestart(uint8_t pin);               // Drop the accumulated synchronized conversions, can be called from ISR
+        uint32_t    syncMilliVolts(uint8_t pin);            // Average synchronized voltage since the previous call, mV
+        void        conversionComplete(void);               // The ADC interrupt handler
+    private:
+        int8_t      channel(uint8_t pin);
+        int8_t      syncIndex(uint8_t pin);
+        uint32_t    toMilliVolts(uint16_t reading, uint8_t frac_bits = 0);
+        volatile uint16_t   ring[SMPL_CHANNELS][SMPL_RING]; // The readings ring buffer of every analog channel
+        volatile uint16_t   summ[SMPL_CHANNELS];            // The summ of readings in the ring buffer
+        volatile uint8_t    len[SMPL_CHANNELS];             // The number of readings in the ring buffer
+        volatile uint8_t    index[SMPL_CHANNELS];           // The next reading position in the ring buffer
+        volatile uint16_t   acc         = 0;                // The conversion accumulator of the active channel
+        volatile uint8_t    count       = 0;                // The number of accumulated conversions
+        volatile uint8_t    active      = 0;                // The active background analog channel
+        volatile bool       drop        = true;             // Drop the next background conversion, the channel has been switched
+        volatile uint8_t    burst       = 0;                // The number of background conversions left in this PWM period
+        volatile bool       sync_conv   = true;             // The next conversion is a synchronized one
+        volatile uint8_t    sync_next   = 0;                // The synchronized pin index of the next triggered conversion
+        uint8_t             sync_ch[2]  = {0};              // The synchronized analog channels
+        volatile uint32_t   sync_acc[2] = {0};              // The synchronized conversion accumulators
+        volatile uint16_t   sync_cnt[2] = {0};              // The number of accumulated synchronized conversions
+        uint16_t            sync_last[2] = {0};             // The last average synchronized reading
+};
+
+#endif
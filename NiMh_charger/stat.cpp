@@ -16,51 +16,26 @@ int32_t EMP_AVERAGE::read(void) {
     return (emp_data + round_v) / emp_k;
 }
 
-HISTORY::HISTORY(uint8_t h_length) {
-    len = 0;
-    this->h_length = h_length;
-    if (h_length > 0)
-        queue = new uint16_t[h_length];
-}
-
-void HISTORY::update(uint16_t item) {
-    if (len < h_length) {
-        queue[len++] = item;
-    } else {
-        queue[index] = item;
-        if (++index >= h_length)                        // Use ring buffer
-            index = 0;
+// Bit by bit integer square root
+uint16_t isqrt(uint32_t x) {
+    uint32_t res = 0;
+    uint32_t bit = 1UL << 30;
+    while (bit > x) bit >>= 2;
+    while (bit) {
+        if (x >= res + bit) {
+            x   -= res + bit;
+            res  = (res >> 1) + bit;
+        } else {
+            res >>= 1;
+        }
+        bit >>= 2;
     }
+    return res;
 }
 
-uint16_t HISTORY::read(void) {
-    uint32_t sum = 0;
-    if (len == 0) return 0;
-    if (len == 1) return queue[0];
-    for (uint8_t i = 0; i < len; ++i) sum += queue[i];
-    sum += len >> 1;                                    // round the average
-    sum /= len;
-    return uint16_t(sum);
-}
-
-uint16_t HISTORY::average(uint16_t item) {
-    update(item);
-    return read();
-}
-
-float HISTORY::dispersion(void) {
-    if (len < 3) return 1000;
-    long sum = 0;
-    long avg = read();
-    for (uint8_t i = 0; i < len; ++i) {
-        long q = queue[i];
-        q -= avg;
-        q *= q;
-        sum += q;
-    }
-    sum += len << 1;
-    float d = (float)sum / (float)len;
-    return d;
+uint16_t statMean(uint32_t sy, uint16_t n) {
+    if (n == 0) return 0;
+    return (sy + (n >> 1)) / n;                         // round the average
 }
 
 /*
@@ -69,41 +44,16 @@ float HISTORY::dispersion(void) {
  * a = (N * sum(Xi*Yi) - sum(Xi) * sum(Yi)) / ( N * sum(Xi^2) - (sum(Xi))^2)
  * b = 1/N * (sum(Yi) - a * sum(Xi))
  * gradient is an 'a' parameter
- * 
+ * Xi is the entry position 1..N, so sum(Xi) = N(N+1)/2, sum(Xi^2) = N(N+1)(2N+1)/6
+ * Centered on the mean position (N+1)/2 the numerator is N/2 * d, where d = 2*sum(Xi*Yi) - (N+1)*sum(Yi),
+ * and the denominator is N^2(N^2-1)/12, so a * 100 = 200 * d / (N(N^2-1)/3), exact in 32 bits for N <= 128
  */
-int32_t HISTORY::gradient(void) {
-    if (len < 3) return 0;                              // The queue is almost empty
-    int32_t sx, sxx, sxy, sy;
-    sx = sxx = sxy = sy = 0;
-    uint8_t item = index;                               // The first item in the queue (ring queue)
-    uint16_t avg = read();                              // Average value
-    for (uint8_t i = 1; i <= len; ++i) {
-        int32_t value = (int32_t)queue[item] - (int32_t)avg; // To increase accuracy, calculate difference between queue data and average value
-        sx    += i;
-        sxx += i*i;
-        sxy   += i*value;
-        sy    += value;
-        if (++item >= h_length) item = 0;
-    }
-    int32_t numerator   = len * sxy - sx * sy;
-    int32_t denominator = len * sxx - sx * sx;
-    return (numerator*100/denominator);
-}
-
-void HISTORY::dump(void) {
-    if (len < h_length) {                               // Partially loaded queue
-        for (uint8_t i = 0; i < len; ++i) {
-            Serial.print(queue[i]);
-            Serial.print(", ");
-        }
-    } else {                                            // Completely loaded queue
-        uint8_t item = index;                           // The first item in the queue (ring queue)
-        for (uint8_t i = 1; i <= len; ++i) {
-            Serial.print(queue[item]);
-            Serial.print(", ");
-            if (++item >= h_length) item = 0;
-        }
-    }
-    Serial.print(F("Gradient = "));
-    Serial.println(gradient());
+int32_t statSlope(uint32_t sxy, uint32_t sy, uint8_t n) {
+    if (n < 2) return 0;
+    int32_t d   = (int32_t)(sxy << 1) - (int32_t)((n + 1) * sy);
+    int32_t den = (int32_t)n * ((int32_t)n * n - 1) / 3;   // (N-1)N(N+1) is a multiple of 3
+    const int32_t lim = INT32_MAX / 200;
+    if (d <= lim && d >= -lim)
+        return d * 200 / den;
+    return d / den * 200 + d % den * 200 / den;         // Steep line, avoid the overflow
 }
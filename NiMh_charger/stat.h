@@ -16,23 +16,143 @@ class EMP_AVERAGE {
         volatile    uint32_t    emp_data    = 0;
 };
 
+/*
+ * Integer statistics of N entries by their exact sums, no floating point.
+ * sy - sum of the entries, sxy - sum of the entries multiplied by position 1..N
+ */
+uint16_t        isqrt(uint32_t x);                      // Integer square root, rounded down
+uint16_t        statMean(uint32_t sy, uint16_t n);      // Rounded average value
+int32_t         statSlope(uint32_t sxy, uint32_t sy, uint8_t n);     // OLS line slope * 100, n <= 128
+
+// Compile-time type selection: HIST_SELECT<condition, T, F>::type is T if the condition is true, F otherwise
+template <bool C, typename T, typename F> struct HIST_SELECT                { typedef T type; };
+template <typename T, typename F>         struct HIST_SELECT<false, T, F>   { typedef F type; };
+
+/*
+ * The history ring buffer of N readings, N is a power of two.
+ * The sums of the readings and the readings weighted by position are updated with every new entry,
+ * so the average value and gradient are calculated in constant time.
+ * The buffer is a class member, no heap allocation. The index and sum widths are the narrowest ones that never overflow.
+ */
+template <uint16_t N>
 class HISTORY {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "HISTORY length should be a power of two");
+    typedef typename HIST_SELECT<(N < 256), uint8_t, uint16_t>::type                tIndex;
+    typedef typename HIST_SELECT<(N == 1), uint16_t, uint32_t>::type                tSum;   // N * 65535
+    typedef typename HIST_SELECT<(N * (N + 1UL) / 2 <= 65537UL), uint32_t, uint64_t>::type tWSum; // N(N+1)/2 * 65535
     public:
-        HISTORY(uint8_t h_length);
-        virtual         ~HISTORY(void)                  { if (h_length > 0) delete [] queue; }
-        uint8_t         length(void)                    { return len; }
-        void            reset(void)                     { len = 0; index = 0; }
+        HISTORY(void)                                   { }
+        uint16_t        length(void)                    { return len; }
+        void            reset(void)                     { len = 0; index = 0; sy = 0; sxy = 0; }
         uint16_t        read(void);                     // Calculate the average value
         void            update(uint16_t item);          // Add new entry to the history
-        uint16_t        average(uint16_t item);         // Add new value and calculate the average value
-        float           dispersion(void);               // Calculate the math dispersion
-        int32_t         gradient(void);                 // approximating the history with the line (y = ax+b). Return parameter a * 1000
+        uint16_t        average(uint16_t item)          { update(item); return read(); } // Add new value and calculate the average value
+        int32_t         gradient(void);                 // approximating the history with the line (y = ax+b). Return parameter a * 100
         void            dump(void);                     // Dump history data to the serial port
     private:
-        uint16_t        h_length;
-        uint16_t        *queue;
-        uint8_t         len;                            // The number of elements in the queue
-        uint8_t         index;                          // The current element position, use ring buffer
+        uint16_t        queue[N];
+        tIndex          len     = 0;                    // The number of elements in the queue
+        tIndex          index   = 0;                    // The oldest element position, use ring buffer
+        tSum            sy      = 0;                    // Sum of the entries
+        tWSum           sxy     = 0;                    // Sum of the entries multiplied by position, the oldest one has position 1
+};
+
+template <uint16_t N>
+void HISTORY<N>::update(uint16_t item) {
+    if (len < N) {
+        queue[(index + len) & (N - 1)] = item;
+        ++len;
+        sxy += (tWSum)len * item;
+    } else {
+        uint16_t oldest = queue[index];
+        queue[index] = item;
+        index = (index + 1) & (N - 1);                  // Use ring buffer
+        sxy -= sy;                                      // All entries shifted by one position, the oldest one dropped
+        sy  -= oldest;
+        sxy += (tWSum)len * item;
+    }
+    sy  += item;
+}
+
+template <uint16_t N>
+uint16_t HISTORY<N>::read(void) {
+    return statMean(sy, len);
+}
+
+template <uint16_t N>
+int32_t HISTORY<N>::gradient(void) {
+    static_assert(N <= 128, "The gradient is calculated in 32 bits for up to 128 entries");
+    if (len < 3) return 0;                              // The queue is almost empty
+    return statSlope(sxy, sy, len);
+}
+
+/*
+ * Hampel spike rejecting filter of N last readings, N is odd.
+ * The reading is an outlier when its deviation from the window median is greater than
+ * 3 scaled median absolute deviations (3 * 1.4826 * MAD ~ 9/2 MAD), but at least min_dev.
+ * The outlier is replaced by the median. The window keeps the raw readings, so the real step change
+ * passes the filter as soon as it covers a half of the window.
+ * Chain the filter before HISTORY: h.update(f.filter(value))
+ */
+template <uint8_t N>
+class HAMPEL {
+    static_assert(N >= 3 && (N & 1) == 1, "HAMPEL window should be odd, at least 3");
+    public:
+        HAMPEL(uint16_t min_dev) : min_dev(min_dev)     { }
+        void            reset(void)                     { len = 0; index = 0; }
+        uint16_t        filter(uint16_t item);          // Returns the filtered reading
+        uint16_t        outliers(void)                  { return rejected; }
+        void            resetOutliers(void)             { rejected = 0; }
+    private:
+        uint16_t        median(uint16_t *data);         // Sort len elements of the data and return the middle one
+        uint16_t        window[N];
+        uint8_t         len         = 0;                // The number of readings in the window
+        uint8_t         index       = 0;                // The next reading position, use ring buffer
+        uint16_t        rejected    = 0;                // The outliers counter
+        const uint16_t  min_dev;                        // The minimal deviation of the outlier
 };
 
+template <uint8_t N>
+uint16_t HAMPEL<N>::filter(uint16_t item) {
+    window[index] = item;
+    if (++index >= N) index = 0;
+    if (len < N) ++len;
+    if (len < 3) return item;                           // Not enough data to find the outlier
+    uint16_t data[N];
+    for (uint8_t i = 0; i < len; ++i) data[i] = window[i];
+    uint16_t med = median(data);
+    for (uint8_t i = 0; i < len; ++i)
+        data[i] = (window[i] > med)?(window[i] - med):(med - window[i]);
+    uint32_t threshold = (uint32_t)median(data) * 9 / 2;
+    if (threshold < min_dev) threshold = min_dev;
+    uint16_t dev = (item > med)?(item - med):(med - item);
+    if (dev <= threshold) return item;
+    if (rejected < 0xffff) ++rejected;
+    return med;
+}
+
+template <uint8_t N>
+uint16_t HAMPEL<N>::median(uint16_t *data) {
+    for (uint8_t i = 1; i < len; ++i) {                 // Insertion sort, the window is short
+        uint16_t v = data[i];
+        uint8_t  j = i;
+        for ( ; j > 0 && data[j-1] > v; --j)
+            data[j] = data[j-1];
+        data[j] = v;
+    }
+    return data[len >> 1];
+}
+
+template <uint16_t N>
+void HISTORY<N>::dump(void) {
+    tIndex item = index;                                // The first item in the queue (ring queue)
+    for (uint16_t i = 0; i < len; ++i) {
+        Serial.print(queue[item]);
+        Serial.print(", ");
+        item = (item + 1) & (N - 1);
+    }
+    Serial.print(F("Gradient = "));
+    Serial.println(gradient());
+}
+
 #endif
@@ -2,7 +2,7 @@
 #define _TYPES_H_
 
 typedef enum {
-    CH_SLOW = 0, CH_RESTORE, CH_FAST 
+    CH_SLOW = 0, CH_RESTORE, CH_FAST, CH_REFLEX
 } tChargeType;
 
 typedef enum {
@@ -22,6 +22,26 @@ typedef enum {
     SO_ABH = 0, SO_AHB, SO_BAH, SO_BHA, SO_HAB, SO_HBA
 } tSensorOrder;
 
+// The battery detection status of the charger slot
+typedef enum {
+    DETECT_OFF = 0, DETECT_VOLTAGE, DETECT_LOAD, DETECT_PROBE, DETECT_FOUND
+} tDetect;
+
+// The charger slot event posted by the control step
+typedef enum {
+    SLOT_NONE = 0, SLOT_INSERTED, SLOT_REMOVED
+} tSlotEvent;
+
+// The ADC calibration points of the charger channel
+typedef enum {
+    CAL_VOLTAGE = 0, CAL_CHARGE, CAL_DISCHARGE
+} tCalPoint;
+
+// The PID autotune status of the charging channel
+typedef enum {
+    TUNE_OFF = 0, TUNE_SETTLE, TUNE_RELAY, TUNE_DONE, TUNE_FAIL
+} tTune;
+
 // Battery boolean configuration bitmap (reserverd for the future use)
 typedef enum {
     bf_nodischarge = 1                                      // Discharge phase disable flag
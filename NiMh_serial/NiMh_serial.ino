@@ -1,8 +1,9 @@
 #include "config.h"
 #include "encoder.h"
 #include "twin_charger.h"
+#include "cfg.h"
 
-#define MENU_LEN    (6)
+#define MENU_LEN    (8)
 
 static char *menu[MENU_LEN] = { 
     "channel",
@@ -10,7 +11,9 @@ static char *menu[MENU_LEN] = {
     "discharge",
     "charge",
     "heat sink fan",
-    "temperature"        
+    "temperature",
+    "PID autotune",
+    "calibrate"
 };
 static uint8_t  item        = 0;
 static bool     edit        = false;
@@ -18,6 +21,10 @@ static uint8_t  channel     = 0;
 static uint16_t current[2]  = {50, 50};
 static bool     fan         = false;
 static bool     show_temp   = false;
+static uint8_t  tuning      = 2;                // The channel being autotuned, 2 if none
+static uint8_t  cal_step    = 0;                // The calibration step, 0 if not calibrating
+static uint16_t cal_value   = 0;                // The reference value measured by the external meter
+static tCal     cal;                            // The calibration record being built
 
 const uint32_t  passive_period  = 30000;
 const uint32_t  active_period   =  1000;
@@ -25,6 +32,7 @@ const uint32_t  temp_period     =  5000;
 
 RENC        enc(RENC_M_PIN, RENC_S_PIN, RENC_B_PIN);
 TWCHARGER   tchrgr(TWCH_ONE_WIRE, TWCH_FAN_PIN);
+CONFIG      cfg;
 
 // Encoder interrupt handler
 static void rotEncChange(void) {
@@ -61,6 +69,14 @@ void printItem(uint16_t value) {
             case 5:
                 Serial.println("");
                 break;
+            case 6:
+                Serial.print("[");
+                Serial.print(channel);
+                Serial.print(F("] Kp = "));
+                Serial.print(tchrgr.changePID(channel, 1, -1));
+                Serial.print(F(", Ki = "));
+                Serial.println(tchrgr.changePID(channel, 2, -1));
+                break;
             default:
                 Serial.print("[");
                 Serial.print(channel);
@@ -70,11 +86,93 @@ void printItem(uint16_t value) {
     }
 }
 
+/*
+ * The calibration procedure of the channel, one step per button press:
+ * 1. No battery in the slot: capture the voltage & current pin readings at zero input
+ * 2. Insert the battery and enter its voltage measured by the multimeter; start charging by current[channel]
+ * 3. Enter the charging current measured by the multimeter; start discharging
+ * 4. Enter the discharging current measured by the multimeter; save the calibration record
+ * The step is refused until the sampler readings of the channel are steady, see TWCHARGER::calSteady()
+ */
+static void calibrationStep(void) {
+    if (!tchrgr.calSteady(channel)) {           // The sampler still keeps the readings made in the window or before the load changed
+        Serial.println(F("the readings are not steady, press again"));
+        return;
+    }
+    switch (cal_step) {
+        case 0:
+            if (tchrgr.getMode(channel) != MODE_STOP) {
+                Serial.println(F("stop the channel first"));
+                return;
+            }
+            cfg.readCalibration(cal);
+            cal.offset[channel][0] = tchrgr.calReading(channel, CAL_VOLTAGE);
+            cal.offset[channel][1] = tchrgr.calReading(channel, CAL_CHARGE);
+            Serial.print(F("zero offsets: "));
+            Serial.print(cal.offset[channel][0]);
+            Serial.print(F(", "));
+            Serial.println(cal.offset[channel][1]);
+            Serial.println(F("insert battery, enter its voltage, mV"));
+            cal_value = 1200;
+            enc.reset(cal_value, 800, 1800, 1, 10, false);
+            break;
+        case 1:
+            cal.gain[channel][CAL_VOLTAGE] = tchrgr.calGain(channel, CAL_VOLTAGE,
+                tchrgr.calReading(channel, CAL_VOLTAGE), cal.offset[channel][0], cal_value);
+            tchrgr.setChargeCurrent(channel, current[channel]);
+            Serial.println(F("enter the charging current, mA"));
+            cal_value = current[channel];
+            enc.reset(cal_value, 10, 1500, 1, 10, false);
+            break;
+        case 2:
+            cal.gain[channel][CAL_CHARGE] = tchrgr.calGain(channel, CAL_CHARGE,
+                tchrgr.calReading(channel, CAL_CHARGE), cal.offset[channel][1], cal_value);
+            tchrgr.setChargeCurrent(channel, 0);
+            tchrgr.discharge(channel, true);
+            Serial.println(F("enter the discharging current, mA"));
+            enc.reset(cal_value, 10, 1500, 1, 10, false);
+            break;
+        default:
+            cal.gain[channel][CAL_DISCHARGE] = tchrgr.calGain(channel, CAL_DISCHARGE,
+                tchrgr.calReading(channel, CAL_DISCHARGE), cal.offset[channel][0], cal_value);
+            tchrgr.discharge(channel, false);
+            cfg.saveCalibration(cal);
+            tchrgr.calibrate(channel, cal.offset[channel][0], cal.offset[channel][1],
+                cal.gain[channel][CAL_VOLTAGE], cal.gain[channel][CAL_CHARGE], cal.gain[channel][CAL_DISCHARGE]);
+            Serial.print(F("calibration saved, gains "));
+            for (uint8_t p = 0; p < 3; ++p) {
+                Serial.print(cal.gain[channel][p]);
+                Serial.print((p < 2)?", ":"\n");
+            }
+            cal_step = 0;
+            edit = false;
+            enc.reset(item, 0, MENU_LEN-1, 1, 1, true);
+            return;
+    }
+    ++cal_step;
+    edit = true;
+}
+
 void setup() {
     analogReference(EXTERNAL);
     Serial.begin(115200);
     tchrgr.init();
     tchrgr.discoverSensors();
+    tCfg rec;
+    cfg.readConfig(rec);
+    for (uint8_t i = 0; i < 2; ++i) {
+        for (uint8_t b = 0; b < PID_BANDS; ++b) {
+            if (rec.Kp[i][b] && rec.Ki[i][b]) { // The PID coefficients of the current band were tuned
+                tchrgr.changePID(i, 1, rec.Kp[i][b], b);
+                tchrgr.changePID(i, 2, rec.Ki[i][b], b);
+            }
+        }
+    }
+    cfg.readCalibration(cal);
+    for (uint8_t i = 0; i < 2; ++i) {
+        tchrgr.calibrate(i, cal.offset[i][0], cal.offset[i][1],
+            cal.gain[i][CAL_VOLTAGE], cal.gain[i][CAL_CHARGE], cal.gain[i][CAL_DISCHARGE]);
+    }
     attachInterrupt(digitalPinToInterrupt(RENC_M_PIN), rotEncChange, CHANGE);
     enc.init();
     enc.reset(item, 0, MENU_LEN-1, 1, 1, true);
@@ -84,8 +182,16 @@ void setup() {
 void loop() {
     static uint32_t show_battery_ms = 0;
 
+    tchrgr.control();                           // Manage the charging current
+    tchrgr.updateVoltage();                     // Measure the battery voltage of the charging channels
+    if (tchrgr.quietWindow()) {                 // Keep the serial port silent while sampling the voltage
+        tchrgr.sleepIdle();
+        return;
+    }
     if (enc.buttonCheck() > 0) {                // Button pressed
-        if (edit) {                             // Exit from edit mode
+        if (item == 7) {                        // The next calibration step
+            calibrationStep();
+        } else if (edit) {                             // Exit from edit mode
             edit = false;
             enc.reset(item, 0, MENU_LEN-1, 1, 1, true);
             printItem(item);
@@ -146,6 +252,18 @@ void loop() {
                     }
                     tchrgr.debugMode(show_temp);
                     break;
+                case 6:                         // PID autotune of the channel by the charge current
+                    if (tchrgr.getMode(channel) == MODE_STOP && tchrgr.startAutotune(channel, current[channel])) {
+                        tuning = channel;
+                        Serial.print(F("autotune channel "));
+                        Serial.print(channel);
+                        Serial.print(F(" by "));
+                        Serial.print(current[channel]);
+                        Serial.println(F("mA"));
+                    }
+                    show_temp = false;
+                    show_battery_ms = 0;
+                    break;
                default:
                     break;
             }
@@ -167,6 +285,12 @@ void loop() {
                     changed = true;
                 }
                 break;
+            case 7:
+                if (value != cal_value) {
+                    cal_value = value;
+                    changed = true;
+                }
+                break;
             default:
                 break;
         }
@@ -181,6 +305,31 @@ void loop() {
         }
     }
 
+    if (tuning < 2) {                           // PID autotune in progress
+        uint8_t status = tchrgr.autotuneStatus(tuning);
+        if (status == TUNE_DONE) {              // Save the coefficients to the configuration record
+            tCfg rec;
+            cfg.readConfig(rec);
+            uint8_t band = tchrgr.pidBand(tuning);
+            rec.Kp[tuning][band] = tchrgr.changePID(tuning, 1, -1);
+            rec.Ki[tuning][band] = tchrgr.changePID(tuning, 2, -1);
+            cfg.saveConfig(rec);
+            Serial.print(F("autotune complete, channel "));
+            Serial.print(tuning);
+            Serial.print(F(", band "));
+            Serial.print(band);
+            Serial.print(F(": Kp = "));
+            Serial.print(rec.Kp[tuning][band]);
+            Serial.print(F(", Ki = "));
+            Serial.println(rec.Ki[tuning][band]);
+            tuning = 2;
+        } else if (status == TUNE_FAIL) {
+            Serial.print(F("autotune failed, channel "));
+            Serial.println(tuning);
+            tuning = 2;
+        }
+    }
+
     uint32_t n = millis();
     if (n >= show_battery_ms) {
         show_battery_ms = n + passive_period;
@@ -213,6 +362,17 @@ void loop() {
                         show_battery_ms = n + active_period;
                         Serial.print(tchrgr.mA(i));
                         Serial.print(" mA, ");
+                        if (tchrgr.getMode(i) == MODE_CHARGE) {
+                            Serial.print(F("settling "));
+                            Serial.print(tchrgr.settleTime(i));
+                            Serial.print(F("/"));
+                            Serial.print(tchrgr.settleMax(i));
+                            Serial.print(F(" ms, recovery "));
+                            Serial.print(tchrgr.recoverTime(i));
+                            Serial.print(F("/"));
+                            Serial.print(tchrgr.recoverMax(i));
+                            Serial.print(F(" ms, "));
+                        }
                         break;
                     default:
                         break;
@@ -222,25 +382,35 @@ void loop() {
             uint16_t t = tchrgr.temperature(2);
             Serial.print(t/10);
             Serial.print(".");
-            Serial.println(t%10);
+            Serial.print(t%10);
+            Serial.print(F(", control WCET "));
+            Serial.print(tchrgr.controlWCET());
+            Serial.print(F(" us, overruns "));
+            Serial.println(tchrgr.controlOverruns());
         }
     }
     delay(10);
 }
 
+/*
+ * Called by delay() while waiting.
+ * Perform the requested charging current control steps
+ */
+void yield(void) {
+    tchrgr.control();
+}
+
 /*
  * The TIM1 overflow interrupt handler.
  */
 static volatile uint16_t counter = 0;
 ISR(TIMER1_OVF_vect) {
-    if (++counter > 500/4) {                                // 4 times per second.
+    tchrgr.ditherPWM();                                     // Sigma-delta PWM duty of the low current channels
+    tchrgr.pulseTick();                                     // The discharge pulses
+    if (++counter >= CONTROL_PERIOD) {                      // CONTROL_RATE times per second.
         counter = 0;
-        TIMSK1 &= ~_BV(TOIE1);                              // disable the overflow interrupts
-        tchrgr.keepCurrent(0);                              // Manage the power of cnannel "A"
-        TIMSK1 |= _BV(TOIE1);                               // enable the the overflow interrupts
-    } else if (counter == 500/8) {
-        TIMSK1 &= ~_BV(TOIE1);                              // disable the overflow interrupts
-        tchrgr.keepCurrent(1);                              // Manage the channel "B"
-        TIMSK1 |= _BV(TOIE1);                               // enable the the overflow interrupts
+        tchrgr.controlTick(0);                              // Request to manage the power of cnannel "A"
+    } else if (counter == CONTROL_PERIOD/2) {
+        tchrgr.controlTick(1);                              // Request to manage the channel "B"
     }
 }
@@ -0,0 +1,80 @@
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "cfg.h"
+#include "config.h"
+#include "types.h"
+
+bool CONFIG::readConfig(tCfg &rec) {
+    uint8_t *buff = (uint8_t *)&rec;
+    
+    for (uint8_t i = 0; i < sizeof(struct record); ++i) {
+        buff[i] = EEPROM.read(i);
+    }
+    if (crc(buff, sizeof(struct record))) {                     // CRC of the record is OK
+        return true;
+    }
+    // Create default config
+    rec.capacity[0] = rec.capacity[1]   = BATT_CAPACITY;
+    rec.type[0]     = rec.type[1]       = CH_SLOW;
+    rec.loops[0]    = rec.loops[1]      = 0;
+    rec.bit_flag[0] = 0;
+    for (uint8_t b = 0; b < PID_BANDS; ++b) {
+        rec.Kp[0][b]    = rec.Kp[1][b]  = 0;
+        rec.Ki[0][b]    = rec.Ki[1][b]  = 0;
+    }
+    return false;
+}
+
+void  CONFIG::saveConfig(tCfg &rec) {
+    uint8_t *buff = (uint8_t *)&rec;
+    crc(buff, sizeof(struct record), true);
+    for (uint8_t i = 0; i < sizeof(struct record); ++i) {
+        EEPROM.write(i, buff[i]);
+    }
+}
+
+bool CONFIG::readCalibration(tCal &rec) {
+    uint8_t *buff = (uint8_t *)&rec;
+    for (uint8_t i = 0; i < sizeof(struct cal_record); ++i) {
+        buff[i] = EEPROM.read(CAL_EEPROM_ADDR + i);
+    }
+    if (crc(buff, sizeof(struct cal_record))) {                 // CRC of the record is OK
+        return true;
+    }
+    // Nominal calibration: AREF_MV and the nominal resistors
+    for (uint8_t c = 0; c < 2; ++c) {
+        rec.offset[c][0] = rec.offset[c][1] = 0;
+        for (uint8_t p = 0; p < 3; ++p)
+            rec.gain[c][p] = CAL_GAIN_ONE;
+    }
+    return false;
+}
+
+void  CONFIG::saveCalibration(tCal &rec) {
+    uint8_t *buff = (uint8_t *)&rec;
+    crc(buff, sizeof(struct cal_record), true);
+    for (uint8_t i = 0; i < sizeof(struct cal_record); ++i) {
+        EEPROM.write(CAL_EEPROM_ADDR + i, buff[i]);
+    }
+}
+
+bool CONFIG::crc(uint8_t *buff, uint8_t len, bool write) {
+    uint32_t summ = 151;
+    for (uint8_t i = 4; i < len; ++i) {
+        summ <<= 2;
+        summ += buff[i];
+    }
+    if (write) {
+        for (int8_t i = 3; i >= 0; --i) {
+            buff[i] = summ & 0xff;
+            summ >>= 8;
+        }
+        return true;
+    }
+    uint32_t s = 0;
+    for (uint8_t i = 0; i < 4; ++i) {
+        s <<= 8;
+        s |= buff[i];
+    }
+    return (s == summ);
+}
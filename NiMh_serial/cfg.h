@@ -0,0 +1,38 @@
+#ifndef _CFG_H
+#define _CFG_H
+#include "types.h"
+#include "config.h"
+
+//------------------------------------------ Configuration record ----------------------------------------------
+typedef struct record {
+    uint32_t    CRC;
+    uint16_t    capacity[2];                                    // The battery capacity, mAh
+    tChargeType type[2];                                        // The charging type
+    uint8_t     loops[2];                                       // The charging loops, usually 0: do not loop
+    uint8_t     bit_flag[2];
+    uint16_t    Kp[2][PID_BANDS];                               // The PID coefficients of the current bands found by autotune, 0 - use default
+    uint16_t    Ki[2][PID_BANDS];
+} tCfg;
+
+//------------------------------------------ ADC calibration record --------------------------------------------
+#define CAL_EEPROM_ADDR (128)                                   // The reserved EEPROM area of the calibration record
+
+typedef struct cal_record {
+    uint32_t    CRC;
+    uint16_t    offset[2][2];                                   // The voltage & current pin readings at zero input, 1/16 of ADC step
+    uint16_t    gain[2][3];                                     // The voltage, charge & discharge current gains, see tCalPoint. CAL_GAIN_ONE - nominal
+} tCal;
+
+class CONFIG {
+    public:
+        CONFIG()    { }
+        bool        readConfig(tCfg &rec);
+        void        saveConfig(tCfg &rec);
+        bool        readCalibration(tCal &rec);
+        void        saveCalibration(tCal &rec);
+    private:
+        bool        crc(uint8_t *buff, uint8_t len, bool write = false);
+};
+
+
+#endif
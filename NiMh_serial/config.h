@@ -5,6 +5,10 @@
 
 // Aref voltage (setup by voltage source), mV
 #define AREF_MV         (2487)
+// The fractional bits of the fine (oversampled) battery voltage, mV
+#define TWCH_MV_FRAC    (4)
+// The unity gain of the ADC calibration, the gain has 15 fractional bits
+#define CAL_GAIN_ONE    (32768U)
 
 // The LCD I2C interface address
 #define LCD_I2C_ADDR    (0x27)
@@ -43,12 +47,24 @@
 // If the line enabled, 0-th channel will be shown on bottom line of the display
 //#define TWIST_DISPLAY   (1)
 
+// The charging current control loop rate, Hz (50-100). TIMER1 (500 Hz) period should be a multiple of the control period
+#define CONTROL_RATE        (50)
+// The number of the charging current bands with own PID coefficients (keep & precharge, slow charge, fast charge)
+#define PID_BANDS           (3)
+// The charging current below this value (mA) is driven by PWM with sigma-delta dithering
+#define PWM_DITHER_CURRENT  (64)
+
 // Charge resistors resistance, 1/10 Ohms. i.e. 31 for 3.1 Ohm
 #define TWCH_CHARGE_RES_A   (30)
 #define TWCH_CHARGE_RES_B   (31)
 // Discharge resistors resistance, 1/10 Ohms
 #define TWCH_DISCH_RES_A    (11)
 #define TWCH_DISCH_RES_B    (10)
+// The charging current that makes AREF_MV on the charge resistor: the ADC full scale of the channel, mA
+#define TWCH_FULL_SCALE_A   (AREF_MV * 10L / TWCH_CHARGE_RES_A)
+#define TWCH_FULL_SCALE_B   (AREF_MV * 10L / TWCH_CHARGE_RES_B)
+// The maximum charging current, mA. 90% of the lower full scale leaves room for the ripple and the PID overshoot
+#define TWCH_MAX_CURRENT    (((TWCH_FULL_SCALE_A < TWCH_FULL_SCALE_B)?TWCH_FULL_SCALE_A:TWCH_FULL_SCALE_B) * 9 / 10)
 
 // Default battery capacity. Just for reference. Actual capacity can be adjusted through menu setup
 #define BATT_CAPACITY           (2000)
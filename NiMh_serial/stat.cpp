@@ -15,3 +15,20 @@ int32_t EMP_AVERAGE::read(void) {
     uint8_t round_v = emp_k >> 1;
     return (emp_data + round_v) / emp_k;
 }
+
+// Bit by bit integer square root
+uint16_t isqrt(uint32_t x) {
+    uint32_t res = 0;
+    uint32_t bit = 1UL << 30;
+    while (bit > x) bit >>= 2;
+    while (bit) {
+        if (x >= res + bit) {
+            x   -= res + bit;
+            res  = (res >> 1) + bit;
+        } else {
+            res >>= 1;
+        }
+        bit >>= 2;
+    }
+    return res;
+}
@@ -16,4 +16,6 @@ class EMP_AVERAGE {
         volatile    uint32_t    emp_data    = 0;
 };
 
+uint16_t        isqrt(uint32_t x);                      // Integer square root, rounded down
+
 #endif
@@ -1,50 +1,72 @@
+#include <avr/sleep.h>
 #include "twin_charger.h"
 
 void PID::init(uint8_t denominator_p) {                     // PID parameters are initialized from EEPROM by  call
     resetPID();
 }
 
-void PID::resetPID(void) {
-    power   = previous_power = 1300000;                     // Experementally setup
-    i_summ  = 0;
-    curr_h0 = 0;                                            // Start PID process again
-    curr_h1 = 0;
-    reached = false;
+/*
+ * Start the PID process again from the PWM duty learned by feed-forward table.
+ * If the duty is unknown, start from the experimentally setup value.
+ * The previous current is unknown, so the first step has no proportional part.
+ */
+void PID::resetPID(uint16_t duty) {
+    if (duty > 0)
+        power = (int32_t)duty << denominator_p;
+    else
+        power = 1300000UL << 3;                             // Experementally setup for denominator 512
+    backCalculate();
+    curr_h1 = -1;                                           // Start PID process again
+}
+
+void PID::limits(uint16_t low, uint16_t high) {
+    out_min = low;
+    out_max = high;
+}
+
+void PID::backCalculate(void) {
+    int32_t low  = (int32_t)out_min << denominator_p;
+    int32_t high = (int32_t)out_max << denominator_p;
+    sat = true;
+    if (power > high)
+        power = high;
+    else if (power < low)
+        power = low;
+    else
+        sat = false;
 }
 
 int32_t PID::reqPower(int16_t current_set, int16_t actual_current) {
-    if (curr_h0 < 0) {                                     // Use direct formulae because do not know previous temperature
-        power       = 0;
-        i_summ      = 0;
-        i_summ += current_set - actual_current;
-        power = Kp*(current_set - actual_current) + Ki * i_summ;
-    } else {
-        if (!reached && actual_current > current_set) {     // Too much power
-            i_summ  = 0;
-            power   = previous_power;
-            reached = true;
-        }
-        int32_t kp = Kp * (curr_h1  - actual_current);
-        int32_t ki = Ki * (current_set - actual_current);
-        int32_t delta_p = kp + ki;
-        power += delta_p;                                   // Power is stored multiplied by denominator!
-        previous_power  = power;
-    }
-    curr_h0 = curr_h1;
+    int32_t kp = 0;
+    if (curr_h1 >= 0)                                       // The first step after reset has no proportional part
+        kp = Kp[active] * (curr_h1  - actual_current);
+    int32_t ki = Ki[active] * (current_set - actual_current);
+    int32_t delta_p = kp + ki;
+    power += delta_p;                                       // Power is stored multiplied by denominator!
+    backCalculate();
     curr_h1 = actual_current;
-    int32_t pwr = power + (1 << (denominator_p-1));         // prepare the power to divide by denominator, round the result
-    pwr >>= denominator_p;                                  // divide by the denominator
+    int32_t pwr = power + (1 << (denominator_p-PWM_FRAC_BITS-1)); // prepare the power to divide by denominator, round the result
+    pwr >>= denominator_p - PWM_FRAC_BITS;                  // divide by the denominator keeping the fractional bits
+    frac = pwr & ((1 << PWM_FRAC_BITS) - 1);
+    pwr >>= PWM_FRAC_BITS;
     return pwr;
 }
 
-int PID::changePID(uint8_t p, int k) {
+void PID::schedule(uint16_t current_set) {
+    uint8_t b = 0;
+    while (b < PID_BANDS-1 && current_set >= band_edge[b]) ++b;
+    active = b;
+}
+
+int PID::changePID(uint8_t p, int k, uint8_t band) {
+  if (band >= PID_BANDS) band = active;
   switch(p) {
     case 1:
-      if (k >= 0) Kp = k;
-      return Kp;
+      if (k >= 0) Kp[band] = k;
+      return Kp[band];
     case 2:
-      if (k >= 0) Ki = k;
-      return Ki;
+      if (k >= 0) Ki[band] = k;
+      return Ki[band];
     default:
       break;
   }
@@ -68,13 +90,305 @@ void LongPWM::init(void) {
     interrupts();
 }
 
-void LongPWM::duty(uint8_t index, uint16_t d) {
+void LongPWM::duty(uint8_t index, uint16_t d, uint8_t fraction) {
     if (index > 2) return;
     if (d > 8191) d = 8191;
+    if (dith & (1 << index)) {                              // The duty will be applied by TIMER1 overflow interrupt handler
+        uint8_t sreg = SREG;
+        cli();
+        base[index] = d;
+        frac[index] = fraction & ((1 << PWM_FRAC_BITS) - 1);
+        SREG = sreg;
+        return;
+    }
+    uint8_t sreg = SREG;                                    // The 16-bit registers share the TEMP byte with the ISR writes
+    cli();
     if (index)
         OCR1B = d;
     else
         OCR1A = d;
+    SREG = sreg;
+}
+
+void LongPWM::dithering(uint8_t index, bool on) {
+    if (index >= 2) return;
+    uint8_t mask = 1 << index;
+    uint8_t sreg = SREG;
+    cli();
+    if (on) {
+        base[index] = index?OCR1B:OCR1A;                    // Continue from the current duty
+        frac[index] = 0;
+        acc[index]  = 0;
+        dith |= mask;
+    } else {
+        dith &= ~mask;
+    }
+    SREG = sreg;
+}
+
+// The OCR1x registers are double buffered, the new duty is applied at the next PWM period
+void LongPWM::dither(void) {
+    for (uint8_t i = 0; i < 2; ++i) {
+        if (!(dith & (1 << i))) continue;
+        uint16_t d = base[i];
+        uint8_t  a = acc[i] + frac[i];
+        if (a >= (1 << PWM_FRAC_BITS)) {                    // The accumulator overflow, add one step
+            a -= 1 << PWM_FRAC_BITS;
+            ++d;
+        }
+        acc[i] = a;
+        if (i)
+            OCR1B = d;
+        else
+            OCR1A = d;
+    }
+}
+
+void LongPWM::off(void) {
+    uint8_t sreg = SREG;
+    cli();
+    dith    = 0;
+    base[0] = base[1] = 0;
+    frac[0] = frac[1] = 0;
+    OCR1A   = OCR1B = 0;
+    PORTB  &= ~0b00000110;
+    SREG    = sreg;
+}
+
+void AUTOTUNE::start(uint16_t base_duty, uint16_t current_set) {
+    base        = base_duty;
+    d           = base_duty >> 3;                           // 1/8 of the steady duty
+    if (d < 50) d = 50;
+    if (base < d) base = d;
+    if (base + d > PWM_MAX_DUTY) base = PWM_MAX_DUTY - d;
+    set         = current_set;
+    eps         = current_set / 50 + 1;
+    high        = true;
+    c_max       = 0;
+    c_min       = 0x7fff;
+    steps       = 0;
+    cycles      = 0;
+    summ_pp     = 0;
+    summ_period = 0;
+}
+
+uint16_t AUTOTUNE::step(int16_t actual_current) {
+    ++steps;
+    if (actual_current > c_max) c_max = actual_current;
+    if (actual_current < c_min) c_min = actual_current;
+    if (high && actual_current > set + eps) {               // Switch the relay off, the oscillation is complete
+        high = false;
+        if (cycles >= tune_skip) {
+            summ_pp     += c_max - c_min;
+            summ_period += steps;
+        }
+        ++cycles;
+        c_max   = actual_current;
+        c_min   = actual_current;
+        steps   = 0;
+    } else if (!high && actual_current < set - eps) {
+        high = true;
+    }
+    return high?(base + d):(base - d);
+}
+
+/*
+ * Integer only calculation. With C = tune_cycles, the amplitude a = summ_pp/2C, Tu = summ_period/C, so
+ * sqrt(a^2 - eps^2) = sqrt(summ_pp^2 - (2C*eps)^2) / 2C = r / 2C
+ * Kp = 0.45 * Ku * 2^dp = (1.8/pi) * 2C * d * 2^dp / r, 1.8/pi = 37549 / 2^16
+ * Ki = 1.2 * Kp / Tu = 6 * Kp * C / (5 * summ_period)
+ * The radicand is scaled by 4^sh to keep the precision of the small amplitudes, Kp is kept with 8 fractional bits
+ */
+bool AUTOTUNE::calculate(uint8_t denominator_p, int &Kp, int &Ki) {
+    if (!complete()) return false;
+    uint32_t e = 2UL * tune_cycles * eps;
+    if (summ_pp <= e || summ_period < tune_cycles) return false;
+    uint32_t s2 = summ_pp * summ_pp - e * e;
+    int8_t sh = 0;
+    while (s2 < (1UL << 30) && sh < 15) {
+        s2 <<= 2;
+        ++sh;
+    }
+    uint32_t r = isqrt(s2);                                 // r * 2^sh
+    uint64_t num = (uint64_t)d * 2 * tune_cycles * 37549UL;
+    int8_t shift = denominator_p + sh - 8;
+    if (shift >= 0)
+        num <<= shift;
+    else
+        num >>= -shift;
+    uint64_t kp = (num + r/2) / r;                          // Kp * 2^8
+    if (kp < (1UL << 8) || kp > (32000UL << 8)) return false;
+    uint32_t ki = ((uint32_t)kp * 6 * tune_cycles + summ_period * 5 * 128) / (summ_period * 5 * 256);
+    if (ki < 1 || ki > 32000) return false;
+    Kp = (kp + 128) >> 8;
+    Ki = ki;
+    return true;
+}
+
+void FEEDFORWARD::init(void) {
+    for (uint8_t r = 0; r < FF_VOLT_BINS; ++r) {
+        for (uint8_t c = 0; c < FF_CURR_BINS; ++c) {
+            f_duty[r][c]    = 0;
+            f_mA[r][c]      = 0;
+        }
+    }
+}
+
+uint8_t FEEDFORWARD::currentBin(uint16_t mA) {
+    uint8_t c = 0;
+    while (c < FF_CURR_BINS-1 && mA >= curr_edge[c]) ++c;
+    return c;
+}
+
+uint8_t FEEDFORWARD::voltageBin(uint16_t mV) {
+    uint8_t r = 0;
+    while (r < FF_VOLT_BINS-1 && mV >= volt_edge[r]) ++r;
+    return r;
+}
+
+void FEEDFORWARD::learn(uint16_t duty, uint16_t mA, uint16_t mV) {
+    if (duty == 0 || mA == 0) return;
+    uint8_t r = voltageBin(mV);
+    uint8_t c = currentBin(mA);
+    if (f_duty[r][c] == 0) {                                // The first value in the cell
+        f_duty[r][c]    = duty;
+        f_mA[r][c]      = mA;
+        return;
+    }
+    uint32_t a = f_duty[r][c];
+    a = (a * ((1 << avg_shift) - 1) + duty + (1 << (avg_shift-1))) >> avg_shift;
+    f_duty[r][c] = a;
+    a = f_mA[r][c];
+    a = (a * ((1 << avg_shift) - 1) + mA + (1 << (avg_shift-1))) >> avg_shift;
+    f_mA[r][c] = a;
+}
+
+uint16_t FEEDFORWARD::duty(uint16_t mA, uint16_t mV) {
+    uint8_t r = voltageBin(mV);
+    uint16_t d = rowDuty(r, mA);
+    for (uint8_t i = 1; d == 0 && i < FF_VOLT_BINS; ++i) {  // Look at the neighbor rows, the nearest first
+        if (r >= i)
+            d = rowDuty(r-i, mA);
+        if (d == 0 && r+i < FF_VOLT_BINS)
+            d = rowDuty(r+i, mA);
+    }
+    return d;
+}
+
+/*
+ * Find two learned cells around the current (or two nearest cells on one side) and
+ * interpolate the duty linearly. The single learned cell can be used for the current of the same bin only.
+ */
+uint16_t FEEDFORWARD::rowDuty(uint8_t row, uint16_t mA) {
+    int8_t lo = -1, lo2 = -1, hi = -1, hi2 = -1;
+    for (uint8_t c = 0; c < FF_CURR_BINS; ++c) {
+        if (f_duty[row][c] == 0) continue;
+        if (f_mA[row][c] <= mA) {
+            lo2 = lo; lo = c;                               // The cells are ordered by current
+        } else {
+            if (hi < 0) hi = c; else if (hi2 < 0) hi2 = c;
+        }
+    }
+    int8_t a = lo, b = hi;
+    if (a < 0) {
+        a = hi2;
+    } else if (b < 0) {
+        b = lo2;
+    }
+    if (a < 0 || b < 0) {                                   // Only one learned cell in the row
+        int8_t c = (lo >= 0)?lo:hi;
+        if (c >= 0 && c == currentBin(mA))
+            return f_duty[row][c];
+        return 0;
+    }
+    int32_t da = f_duty[row][a], db = f_duty[row][b];
+    int32_t ia = f_mA[row][a],   ib = f_mA[row][b];
+    if (ia == ib) return (da + db) / 2;
+    int32_t d = da + (db - da) * ((int32_t)mA - ia) / (ib - ia);
+    return constrain(d, 1, PWM_MAX_DUTY);
+}
+
+void COULOMB::reset(void) {
+    uint8_t sreg = SREG;
+    cli();
+    charge = energy = 0;
+    SREG = sreg;
+    q_rem = e_rem = 0;
+}
+
+/*
+ * Integrate the current mA over us microseconds at the battery voltage mV.
+ * The long interval is split into COUL_MAX_STEP parts, the regular control step is one part.
+ */
+void COULOMB::count(uint16_t mA, uint32_t us, uint16_t mV) {
+    uint32_t n = 0;                                         // uAh counted in this call
+    while (us > 0) {
+        uint32_t step = (us > COUL_MAX_STEP)?COUL_MAX_STEP:us;
+        us -= step;
+        q_rem += (uint32_t)mA * step;
+        if (q_rem >= COUL_MA_US) {
+            uint32_t q = q_rem / COUL_MA_US;
+            q_rem -= q * COUL_MA_US;
+            n += q;
+        }
+    }
+    if (n == 0) return;
+    uint32_t e = n * mV + e_rem;                            // nWh
+    uint32_t w = e / 1000;
+    e_rem = e - w * 1000;
+    uint8_t sreg = SREG;
+    cli();
+    charge += n;
+    energy += w;
+    SREG = sreg;
+}
+
+uint32_t COULOMB::uAh(void) {
+    uint8_t sreg = SREG;
+    cli();
+    uint32_t q = charge;
+    SREG = sreg;
+    return q;
+}
+
+uint32_t COULOMB::uWh(void) {
+    uint8_t sreg = SREG;
+    cli();
+    uint32_t e = energy;
+    SREG = sreg;
+    return e;
+}
+
+/*
+ * The round-trip efficiency of the battery is the ratio of the completed discharge to the full charge preceding it.
+ * The first discharge of the session starts from an unknown state of charge, so the efficiency is known
+ * when the charge loop discharges the battery charged by the previous cycle. The ratio is limited by 255%
+ */
+static uint8_t efficiency(uint32_t out, uint32_t in) {
+    in = (in + 50) / 100;
+    if (out == 0 || in == 0) return 0;
+    uint32_t e = (out + in/2) / in;
+    return (e > 255)?255:e;
+}
+
+// Keep the counters of the full charge before they are reset for the new discharge
+void TWCHARGER::initDischargeCounter(uint8_t index, bool full) {
+    if (index >= 2) return;
+    full_uAh[index] = full?charge_cnt[index].uAh():0;
+    full_uWh[index] = full?charge_cnt[index].uWh():0;
+    dische_cnt[index].reset();
+}
+
+uint8_t TWCHARGER::coulombEfficiency(uint8_t index) {
+    if (index >= 2 || mode[index] == MODE_DISCHARGE || mode[index] == MODE_WAS_DISCHARGE)
+        return 0;                                           // The discharge is not completed yet
+    return efficiency(dische_cnt[index].uAh(), full_uAh[index]);
+}
+
+uint8_t TWCHARGER::energyEfficiency(uint8_t index) {
+    if (index >= 2 || mode[index] == MODE_DISCHARGE || mode[index] == MODE_WAS_DISCHARGE)
+        return 0;
+    return efficiency(dische_cnt[index].uWh(), full_uWh[index]);
 }
 
 TWCHARGER::TWCHARGER(uint8_t one_wire_pin, uint8_t fan_pin) : ds(one_wire_pin){
@@ -93,6 +407,7 @@ TWCHARGER::TWCHARGER(uint8_t one_wire_pin, uint8_t fan_pin) : ds(one_wire_pin){
 
 void TWCHARGER::init(void) {
     pwm.init();
+    adc.init(current_pin[0], current_pin[1]);               // The charging current is sampled synchronously with PWM
     pinMode(enable_pin[0],      OUTPUT);
     pinMode(enable_pin[1],      OUTPUT);
     pinMode(discharge_pin[0],   OUTPUT);
@@ -113,8 +428,20 @@ void TWCHARGER::init(void) {
     current[1]  = 0;
     ch_pid[0].init();
     ch_pid[1].init();
-    voltage_update  = 0;
+    ch_pid[0].limits(pwm.minDuty(), pwm.maxDuty());
+    ch_pid[1].limits(pwm.minDuty(), pwm.maxDuty());
+    ff[0].init();
+    ff[1].init();
+    calibrate(0, 0, 0, CAL_GAIN_ONE, CAL_GAIN_ONE, CAL_GAIN_ONE);
+    calibrate(1, 0, 0, CAL_GAIN_ONE, CAL_GAIN_ONE, CAL_GAIN_ONE);
+    voltage_update[0]   = 0;
+    voltage_update[1]   = voltage_period/2;
+    mode_time[0]        = 0;
+    mode_time[1]        = 0;
+    measuring           = 2;
     temp_update     = 0;
+    temp_time       = 0;
+    converting      = false;
 }
 
 bool TWCHARGER::setSensorAddress(uint8_t index, const uint8_t addr[8]) {
@@ -154,114 +481,347 @@ bool TWCHARGER::getSensorAddress(uint8_t index, uint8_t addr[8]) {
     return false;
 }
 
-// The battery sensor temperature, 1/100 of Celsius
+// The battery sensor temperature, 1/10 of Celsius. Returns the cached value, never waits for the conversion
 int16_t TWCHARGER::temperature(uint8_t index) {
-    if (index < 3 && OneWire::crc8(ds1820b_addr[index], 7) == ds1820b_addr[index][7]) {
-        if (temp[index] == 0 || no_expiration || now() >= temp_update) {
-            temp_update = now() + temp_expiration;
-            uint8_t type_s = 0;
-            switch (ds1820b_addr[index][0]) {
-                case 0x10:
-                    type_s = 1;
-                    break;
-                case 0x28:
-                case 0x22:
-                    break;
-                default:
-                    temp[index] = 0;
-                    return 0;
-            }        
-            ds.reset();
-            ds.select(ds1820b_addr[index]);
-            ds.write(0x44, 1);                              // start conversion, with parasite power on at the end
-            delay(1000);                                    // wait for conversion finished                    
-            if (ds.reset()) {                               // return 1 if the device found on the bus
-                ds.select(ds1820b_addr[index]);    
-                ds.write(0xBE);                             // Read Scratchpad
-                uint8_t data[12];
-                for (uint8_t j = 0; j < 9; j++) {           // we need 9 bytes
-                    data[j] = ds.read();
-                }
-                int16_t raw = (data[1] << 8) | data[0];     // Convert the data to actual temperature
-                if (type_s) {
-                    raw = raw << 3;                         // 9 bit resolution default
-                    if (data[7] == 0x10) {
-                        raw = (raw & 0xFFF0) + 12 - data[6];// "count remain" gives full 12 bit resolution
-                    }
-                } else {
-                    uint8_t cfg = (data[4] & 0x60);         // at lower res, the low bits are undefined, so let's zero them
-                    if (cfg == 0x00) raw = raw & ~7;        // 9 bit resolution, 93.75 ms
-                    else if (cfg == 0x20) raw = raw & ~3;   // 10 bit res, 187.5 ms
-                    else if (cfg == 0x40) raw = raw & ~1;   // 11 bit res, 375 ms
-                }
-                raw *= 5;                                   // celsius = float(raw). We return celsuis*10 (raw*5/8)
-                raw >>= 3;                                  // divide by 8
-                temp[index] = raw;
-                return raw;        
-            }
-        }
+    updateTemperature();
+    if (index < 3)
         return temp[index];
-    }
     return 0;
 }
 
 /*
- * Stop Any charge/discharge activity to check voltage of both batteries
- * save measured data for expiration_period
+ * The temperature sensors state machine. It never waits for the conversion to be finished.
+ * Start the conversion on all the sensors at once by "Skip ROM" command and return.
+ * When the conversion time elapsed, read the scratchpads of all sensors and publish the temperature cache.
+ * Returns true when the new temperature values have been published
+ */
+bool TWCHARGER::updateTemperature(void) {
+    uint32_t n = millis();
+    if (!converting) {
+        if (!no_expiration && n < temp_update) return false;
+        temp_update = n + temp_period;
+        if (!ds.reset()) return false;                      // No sensor found on the bus
+        ds.skip();                                          // Address all the sensors on the bus
+        ds.write(0x44, 1);                                  // start conversion, with parasite power on at the end
+        converting  = true;
+        temp_update = n + conversion_time;
+        return false;
+    }
+    if (n < temp_update) return false;                      // The conversion is in progress
+    converting  = false;
+    temp_update = n + temp_period;
+    for (uint8_t i = 0; i < 3; ++i) {
+        int16_t t = 0;
+        if (readSensor(i, t))
+            temp[i] = t;
+    }
+    temp_time = n;
+    return true;
+}
+
+// Read the scratchpad of the sensor and convert the data to the temperature, 1/10 of Celsius
+bool TWCHARGER::readSensor(uint8_t index, int16_t &t) {
+    if (index >= 3 || OneWire::crc8(ds1820b_addr[index], 7) != ds1820b_addr[index][7])
+        return false;
+    uint8_t type_s = 0;
+    switch (ds1820b_addr[index][0]) {
+        case 0x10:
+            type_s = 1;
+            break;
+        case 0x28:
+        case 0x22:
+            break;
+        default:
+            return false;
+    }
+    if (!ds.reset()) return false;                          // return 1 if the device found on the bus
+    ds.select(ds1820b_addr[index]);
+    ds.write(0xBE);                                         // Read Scratchpad
+    uint8_t data[9];
+    for (uint8_t j = 0; j < 9; j++) {                       // we need 9 bytes
+        data[j] = ds.read();
+    }
+    if (OneWire::crc8(data, 8) != data[8]) return false;    // Corrupted data, keep the previous value
+    int16_t raw = (data[1] << 8) | data[0];                 // Convert the data to actual temperature
+    if (type_s) {
+        raw = raw << 3;                                     // 9 bit resolution default
+        if (data[7] == 0x10) {
+            raw = (raw & 0xFFF0) + 12 - data[6];            // "count remain" gives full 12 bit resolution
+        }
+    } else {
+        uint8_t cfg = (data[4] & 0x60);                     // at lower res, the low bits are undefined, so let's zero them
+        if (cfg == 0x00) raw = raw & ~7;                    // 9 bit resolution, 93.75 ms
+        else if (cfg == 0x20) raw = raw & ~3;               // 10 bit res, 187.5 ms
+        else if (cfg == 0x40) raw = raw & ~1;               // 11 bit res, 375 ms
+    }
+    raw *= 5;                                               // celsius = float(raw). We return celsuis*10 (raw*5/8)
+    raw >>= 3;                                              // divide by 8
+    t = raw;
+    return true;
+}
+
+/*
+ * The battery voltage.
+ * When the channel is neither charging nor discharging long enough, the voltage is read from the sampler directly.
+ * Otherwise, the value measured in the last measurement window of the channel is returned (see updateVoltage())
  */
 uint16_t TWCHARGER::mV(uint8_t index) {
-    if (index < 2) {
-        if (no_expiration || now() >= voltage_update) {     // Switch off all chargings and perform the voltage checking                         
-            for (uint8_t i = 0; i < 2; ++i) {
-                if (mode[i] == MODE_CHARGE) {
-                    mode[i] = MODE_WAS_CHARGE;              // Change mode to inform keepCurrent() procedure
-                    digitalWrite(enable_pin[i], LOW);       // Stop charging
-                }
-                digitalWrite(discharge_pin[i], LOW);        // Stop discharging
-            }
-            delay(50);
-            voltage[0] = milliVolts(voltage_pin[0]);
-            voltage[1] = milliVolts(voltage_pin[1]);
-            for (uint8_t i = 0; i < 2; ++i) {
-                if (mode[i] == MODE_WAS_CHARGE) {
-                    mode[i] = MODE_CHARGE;
-                    digitalWrite(enable_pin[i], HIGH);      // Restore charging
-                } else if (mode[i] == MODE_DISCHARGE) {
-                    digitalWrite(discharge_pin[i], HIGH);   // Restore discharging
-                }
-            }
-            voltage_update = now() + voltage_expiration;
+    if (index >= 2) return 0;
+    if ((mode[index] == MODE_STOP || mode[index] == MODE_PAUSE) && millis() >= mode_time[index] + idle_time
+            && !pulsing(index) && adc.ready(voltage_pin[index])) {
+        storeVoltage(index);
+    } else {
+        updateVoltage();
+    }
+    return voltage[index];
+}
+
+uint16_t TWCHARGER::fineMV(uint8_t index) {
+    if (index >= 2) return 0;
+    mV(index);                                              // Update the voltage cache
+    return voltage_fine[index];
+}
+
+void TWCHARGER::storeVoltage(uint8_t index) {
+    uint8_t pin = voltage_pin[index];
+    voltage_fine[index] = convert(adc.read(pin), cal_offset[index][0], cal_k[index][CAL_VOLTAGE]);
+    voltage[index]      = (voltage_fine[index] + (1 << (TWCH_MV_FRAC-1))) >> TWCH_MV_FRAC;
+    voltage_bits[index] = adc.resolution(pin);
+}
+
+/*
+ * The energy is counted at the battery terminal voltage under the load. The cached voltage is measured without the load
+ * in the window, so the latest reading of the voltage pin is used: it is made in the current mode of the channel
+ * and averages the PWM ripple over SMPL_OVERSAMPLE conversions
+ */
+uint16_t TWCHARGER::loadMV(uint8_t index) {
+    uint16_t fine = convert(adc.latest(voltage_pin[index]), cal_offset[index][0], cal_k[index][CAL_VOLTAGE]);
+    return (fine + (1 << (TWCH_MV_FRAC-1))) >> TWCH_MV_FRAC;
+}
+
+/*
+ * The voltage measurement windows.
+ * The charging (discharging) channel is suspended every voltage_period to check the battery voltage without the load.
+ * Only the measured channel is suspended. The windows of two channels never overlap,
+ * the channels schedules are shifted by a half of the period (see setMode()).
+ */
+void TWCHARGER::updateVoltage(void) {
+    uint32_t n = millis();
+    if (measuring < 2) {                                    // The measurement window is open
+        uint8_t i = measuring;
+        if (!settled) {
+            if (n < window_start + settle_time) return;     // Wait for the battery voltage is settled
+            adc.restart(voltage_pin[i]);                    // Drop the readings made under the load
+            settled = true;
+            return;
         }
-        return voltage[index];
+        if (!adc.full(voltage_pin[i])) return;              // Wait for the 13-bit decimated reading, about 120 ms
+        storeVoltage(i);
+        voltage_update[i] = window_start + voltage_period;
+        closeWindow(i);
+        return;
+    }
+    for (uint8_t i = 0; i < 2; ++i) {
+        if (n < voltage_update[i]) continue;
+        if (pulsing(i)) continue;                           // Do not break the discharge pulse, open the window later
+        if (mode[i] == MODE_CHARGE) {
+            mode[i] = MODE_WAS_CHARGE;                      // Change mode to inform keepCurrent() procedure
+            digitalWrite(enable_pin[i], LOW);               // Stop charging
+        } else if (mode[i] == MODE_DISCHARGE) {
+            mode[i] = MODE_WAS_DISCHARGE;
+            digitalWrite(discharge_pin[i], LOW);            // Stop discharging
+        } else {
+            continue;                                       // The voltage of idle channel is read directly
+        }
+        measuring       = i;
+        settled         = false;
+        window_start    = n;
+        break;
     }
-    return 0;
+}
+
+/*
+ * Called by the main loop while the voltage window collects the readings (see quietWindow()).
+ * The ADC noise reduction sleep mode halts clkIO, i.e. TIMER1 that generates the PWM and the control ticks,
+ * so the idle mode is used: only the CPU and flash clocks are halted. The conversions are made while the CPU sleeps
+ * between the interrupts, the PWM, the ADC sampler and the control ticks are not disturbed.
+ */
+void TWCHARGER::sleepIdle(void) {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sleep_cpu();                                            // Wake up by the next interrupt, ADC or TIMER1
+    sleep_disable();
+}
+
+// Close the voltage measurement window of the channel, restore the charger mode
+void TWCHARGER::closeWindow(uint8_t index) {
+    if (measuring != index) return;
+    if (mode[index] == MODE_WAS_CHARGE) {
+        mode[index] = MODE_CHARGE;
+        digitalWrite(enable_pin[index], HIGH);              // Restore charging
+        adc.syncRestart(current_pin[index]);                // Drop the current samples made in the window
+    } else if (mode[index] == MODE_WAS_DISCHARGE) {
+        mode[index] = MODE_DISCHARGE;
+        digitalWrite(discharge_pin[index], HIGH);           // Restore discharging
+    }
+    load_time[index] = millis();
+    cal_acc[index] = cal_cnt[index] = 0;
+    measuring = 2;
+}
+
+/*
+ * Change the charger mode of the channel.
+ * When the channel becomes active, schedule its voltage measurement window
+ * in the middle between the windows of the other channel
+ */
+void TWCHARGER::setMode(uint8_t index, TWCH_MODE m) {
+    closeWindow(index);
+    if (m != MODE_PAUSE)                                    // pulseTick() does not restore the charging power of the paused channel
+        stopPulse(index);                                   // The new mode owns the charge and discharge pins
+    if (mode[index] == m) return;
+    uint32_t n = millis();
+    bool was_idle = (mode[index] == MODE_STOP || mode[index] == MODE_PAUSE);
+    if (was_idle && (m == MODE_CHARGE || m == MODE_DISCHARGE)) {
+        uint32_t next = voltage_update[index ^ 1] + voltage_period/2;
+        if (next < n)
+            next += ((n - next) / voltage_period + 1) * voltage_period;
+        voltage_update[index] = next;
+    }
+    mode[index]         = m;
+    mode_time[index]    = n;
+    load_time[index]    = n;
+    cal_acc[index]      = cal_cnt[index] = 0;
 }
 
 uint16_t TWCHARGER::mA(uint8_t index) {
     if (index < 2) {
-        uint32_t v      = 0;
-        uint32_t res    = 1;
-        if (mode[index] == MODE_DISCHARGE) {
-            v   = milliVolts(voltage_pin[index]);
-            res = (index==0)?TWCH_DISCH_RES_A:TWCH_DISCH_RES_B;
-        } else {
-            v   = milliVolts(current_pin[index]);
-            res = (index==0)?TWCH_CHARGE_RES_A:TWCH_CHARGE_RES_B;
-        }
-        v *= 10;                                            // Because thge resistance is in 1/10 ohm
-        v += res/2;                                         // Round the result
-        return v / res;
+        if (mode[index] == MODE_DISCHARGE)
+            return convert(adc.read(voltage_pin[index]), cal_offset[index][0], cal_k[index][CAL_DISCHARGE]);
+        return convert(adc.read(current_pin[index]), cal_offset[index][1], cal_k[index][CAL_CHARGE]);
     }
     return 0;
 }
 
+/*
+ * The charging current sampled synchronously with PWM since the previous call.
+ * The readings of the settled current are averaged for the calibration, see calReading()
+ */
+uint16_t TWCHARGER::syncCurrent(uint8_t index) {
+    uint16_t r = adc.sync(current_pin[index]);
+    if (settle_start[index] == 0) {
+        if (cal_cnt[index] >= TWCH_CAL_STEPS) {             // Forget the old readings by half
+            cal_acc[index] >>= 1;
+            cal_cnt[index] >>= 1;
+        }
+        cal_acc[index] += r;
+        ++cal_cnt[index];
+    } else {
+        cal_acc[index] = cal_cnt[index] = 0;
+    }
+    return convert(r, cal_offset[index][1], cal_k[index][CAL_CHARGE]);
+}
+
+/*
+ * The sampler reading is 1/SMPL_OVERSAMPLE of ADC step. The nominal multipliers (16 fractional bits):
+ * fine voltage: AREF_MV * 2^TWCH_MV_FRAC / (1023 * SMPL_OVERSAMPLE)
+ * current:      AREF_MV * 10 / (1023 * SMPL_OVERSAMPLE * res), the resistance is in 1/10 Ohm
+ */
+uint32_t TWCHARGER::nominal(uint8_t index, uint8_t point) {
+    const uint32_t steps = 1023UL * SMPL_OVERSAMPLE;
+    uint32_t res = 0;
+    switch (point) {
+        case CAL_VOLTAGE:
+            return (((uint32_t)AREF_MV << (16 + TWCH_MV_FRAC)) + steps/2) / steps;
+        case CAL_CHARGE:
+            res = (index == 0)?TWCH_CHARGE_RES_A:TWCH_CHARGE_RES_B;
+            break;
+        default:
+            res = (index == 0)?TWCH_DISCH_RES_A:TWCH_DISCH_RES_B;
+            break;
+    }
+    return (((uint32_t)AREF_MV * 10 << 16) + steps*res/2) / (steps * res);
+}
+
+/*
+ * Apply the channel calibration: the pin readings at zero input and the gains of the voltage,
+ * charge & discharge current (CAL_GAIN_ONE is nominal). The conversion multipliers are calculated once here,
+ * so the conversion is a multiplication and a shift. The gain is limited to 0.5...1.5 to keep the product in 32 bits.
+ */
+void TWCHARGER::calibrate(uint8_t index, uint16_t v_offset, uint16_t c_offset, uint16_t v_gain, uint16_t c_gain, uint16_t d_gain) {
+    if (index >= 2) return;
+    uint16_t gain[3] = {v_gain, c_gain, d_gain};
+    cal_offset[index][0] = v_offset;
+    cal_offset[index][1] = c_offset;
+    for (uint8_t p = 0; p < 3; ++p) {
+        uint16_t g = constrain(gain[p], CAL_GAIN_ONE/2, CAL_GAIN_ONE + CAL_GAIN_ONE/2);
+        uint32_t k = nominal(index, p);                     // Split the product to keep it in 32 bits
+        cal_k[index][p] = (k >> 15) * g + (((k & 0x7fff) * g + CAL_GAIN_ONE/2) >> 15);
+    }
+}
+
+/*
+ * The charging current is converted from the synchronized readings (see syncCurrent()), they sample
+ * a different point of the PWM cycle than the background ones. So the charge gain is fitted on the average
+ * of the synchronized readings. The channel that does not charge has no PWM ripple, the background reading is used.
+ */
+uint16_t TWCHARGER::calReading(uint8_t index, uint8_t point) {
+    if (index >= 2) return 0;
+    if (point == CAL_CHARGE && cal_cnt[index] > 0)
+        return (cal_acc[index] + cal_cnt[index]/2) / cal_cnt[index];
+    return adc.read((point == CAL_CHARGE)?current_pin[index]:voltage_pin[index]);
+}
+
+/*
+ * The ring buffer of the pin keeps the readings of about 120 ms, so it can still hold the no-load readings
+ * of the voltage window or the readings of the previous set point. The calibration reading is valid
+ * when the channel has been kept under the same load for the whole ring, TWCH_RING_MS, without a window.
+ * The discharge pulse in progress makes the reading invalid as well. The charging current should be settled by PID.
+ */
+bool TWCHARGER::calSteady(uint8_t index) {
+    if (index >= 2 || measuring == index || pulsing(index)) return false;
+    if (mode[index] == MODE_CHARGE && (settle_start[index] != 0 || cal_cnt[index] == 0)) return false;
+    return millis() - load_time[index] >= TWCH_RING_MS;
+}
+
+/*
+ * The gain that converts the reading to the reference value measured by the external meter.
+ * The value is mV for CAL_VOLTAGE and mA for the current points
+ */
+uint16_t TWCHARGER::calGain(uint8_t index, uint8_t point, uint16_t reading, uint16_t offset, uint16_t value) {
+    if (index >= 2 || reading <= offset) return CAL_GAIN_ONE;
+    uint32_t k = nominal(index, point);
+    uint32_t n = convert(reading, offset, k);               // The nominal value of the reading
+    if (point == CAL_VOLTAGE)
+        n = (n + (1 << (TWCH_MV_FRAC-1))) >> TWCH_MV_FRAC;
+    if (n == 0) return CAL_GAIN_ONE;
+    uint32_t g = ((uint32_t)value * CAL_GAIN_ONE + n/2) / n;
+    return constrain(g, CAL_GAIN_ONE/2, CAL_GAIN_ONE + CAL_GAIN_ONE/2);
+}
+
+uint16_t TWCHARGER::convert(uint16_t reading, uint16_t offset, uint32_t k) {
+    reading = (reading > offset)?(reading - offset):0;
+    return ((uint32_t)reading * k + 0x8000) >> 16;
+}
+
+// Convert the voltage on the resistor (mV) to the current (mA). The resistance is in 1/10 Ohm
+uint16_t TWCHARGER::milliAmps(uint32_t mV, uint32_t res) {
+    mV *= 10;                                               // Because thge resistance is in 1/10 ohm
+    mV += res/2;                                            // Round the result
+    return mV / res;
+}
+
+// The charger mode of the channel. The channel suspended to measure the voltage is reported in its actual mode
+uint8_t TWCHARGER::getMode(uint8_t index) {
+    if (index >= 2) return MODE_STOP;
+    if (mode[index] == MODE_WAS_CHARGE) return MODE_CHARGE;
+    if (mode[index] == MODE_WAS_DISCHARGE) return MODE_DISCHARGE;
+    return mode[index];
+}
+
 void TWCHARGER::discharge(uint8_t index, bool on) {
     if (index < 2) {
-        if (on) {                                           // Switch off charging voltage
-            mode[index] = MODE_DISCHARGE;
-        } else {
-            mode[index] = MODE_STOP;
-        }
+        pulseTrain(index, 0);
+        setMode(index, on?MODE_DISCHARGE:MODE_STOP);        // Switch off charging voltage
         digitalWrite(enable_pin[index], LOW);               // Switch charging power off
         pwm.duty(index, 0);                                 // No voltage to LM317
         current[index] = 0;
@@ -269,103 +829,492 @@ void TWCHARGER::discharge(uint8_t index, bool on) {
     }
 }
 
-void TWCHARGER::pulseDischarge(uint8_t index, uint16_t ms) {
-    if (mode[index] == MODE_CHARGE) {
-        mode[index] = MODE_DISCHARGE;
-        digitalWrite(enable_pin[index], LOW);
-        digitalWrite(discharge_pin[index], HIGH);
-        delay(ms);
-        digitalWrite(discharge_pin[index], LOW);;
-        digitalWrite(enable_pin[index], HIGH);
-        mode[index] = MODE_CHARGE;
+// Convert the time interval to the number of PWM periods, rounded
+static uint16_t pwmPeriods(uint16_t ms) {
+    return ((uint32_t)ms * PWM_FREQUENCY + 500) / 1000;
+}
+
+/*
+ * Request the discharge pulse of the charging or paused channel. The pulse is generated by pulseTick() in the TIMER1 ISR,
+ * it starts at the next PWM period and lasts ms rounded to the whole PWM periods (2 ms).
+ * Then the charging power stays off for rest_ms more.
+ * The channel stays in its mode, the control step is suspended while the pulse lasts.
+ * The pulse requested right before the pause is not cancelled by the pause (see setMode()).
+ */
+void TWCHARGER::pulseDischarge(uint8_t index, uint16_t ms, uint16_t rest_ms) {
+    if (index >= 2) return;
+    closeWindow(index);
+    if ((mode[index] != MODE_CHARGE && mode[index] != MODE_PAUSE) || pulsing(index)) return;
+    uint16_t periods = pwmPeriods(ms);
+    if (periods == 0) periods = 1;
+    if (periods > 255) periods = 255;
+    uint16_t rest = pwmPeriods(rest_ms);
+    if (periods + rest > 255) rest = 255 - periods;
+    uint8_t sreg = SREG;
+    cli();
+    pulse_left[index] = periods + rest;
+    pulse_rest[index] = rest;
+    pulse_req |= 1 << index;
+    SREG = sreg;
+}
+
+/*
+ * Start the reflex (burp) charging pulse train on the charging channel: every charge_ms of charging
+ * the discharge pulse of burp_ms is applied, then the battery rests for rest_ms.
+ * The train is generated by pulseTick(), it is suspended while the channel is not in MODE_CHARGE,
+ * and is stopped when the charging current changes or by charge_ms == 0.
+ */
+void TWCHARGER::pulseTrain(uint8_t index, uint16_t charge_ms, uint16_t burp_ms, uint16_t rest_ms) {
+    if (index >= 2) return;
+    uint16_t burp = pwmPeriods(burp_ms);
+    uint16_t rest = pwmPeriods(rest_ms);
+    if (burp == 0) burp = 1;
+    if (burp > 255) burp = 255;
+    if (burp + rest > 255) rest = 255 - burp;
+    uint8_t sreg = SREG;
+    cli();
+    train_period[index] = pwmPeriods(charge_ms);
+    train_cnt[index]    = train_period[index];
+    train_burp[index]   = burp;
+    train_rest[index]   = rest;
+    SREG = sreg;
+}
+
+/*
+ * Called every PWM period from the TIMER1 overflow interrupt handler.
+ * Starts the requested discharge pulse and finishes it in pulse_left periods,
+ * so the pulse width is exact and the main loop is never suspended.
+ * The reflex pulse train requests the next discharge pulse at the end of the charge pulse.
+ */
+void TWCHARGER::pulseTick(void) {
+    for (uint8_t i = 0; i < 2; ++i) {
+        uint8_t mask = 1 << i;
+        if (train_period[i] > 0 && mode[i] == MODE_CHARGE && !(pulse_req & mask) && pulse_left[i] == 0) {
+            if (--train_cnt[i] == 0) {                      // End of the charge pulse
+                train_cnt[i]    = train_period[i];
+                pulse_left[i]   = train_burp[i] + train_rest[i];
+                pulse_rest[i]   = train_rest[i];
+                pulse_req      |= mask;
+            }
+        }
+        if (pulse_req & mask) {
+            pulse_req &= ~mask;
+            digitalWrite(enable_pin[i], LOW);
+            digitalWrite(discharge_pin[i], HIGH);
+        } else if (pulse_left[i] > 0) {
+            if (--pulse_left[i] == 0) {
+                digitalWrite(discharge_pin[i], LOW);
+                if (mode[i] == MODE_CHARGE) {
+                    digitalWrite(enable_pin[i], HIGH);      // Restore charging
+                    adc.syncRestart(current_pin[i]);        // Drop the current samples made in the pulse
+                }
+            } else if (pulse_left[i] == pulse_rest[i]) {
+                digitalWrite(discharge_pin[i], LOW);        // The discharge pulse complete, rest
+            }
+        }
     }
 }
 
+void TWCHARGER::stopPulse(uint8_t index) {
+    if (!pulsing(index)) return;
+    uint8_t sreg = SREG;
+    cli();
+    pulse_req &= ~(1 << index);
+    pulse_left[index] = 0;
+    SREG = sreg;
+    digitalWrite(discharge_pin[index], LOW);                // The caller manages the charging power
+}
+
 void TWCHARGER::setChargeCurrent(uint8_t index, uint16_t mA) {
     if (index > 2) return;
+    pulseTrain(index, 0);                                   // The charging phase starts the reflex pulses after setting the current
+    if (mA > TWCH_MAX_CURRENT)                              // The higher current cannot be measured, so cannot be controlled
+        mA = TWCH_MAX_CURRENT;
     if (mA >0) {                                            // Start charging
-        mode[index] = MODE_CHARGE;
+        bool charging = (mode[index] == MODE_CHARGE || mode[index] == MODE_WAS_CHARGE);
+        setMode(index, MODE_CHARGE);
         digitalWrite(discharge_pin[index], LOW);            // Make sure stop discharging
         digitalWrite(enable_pin[index], HIGH);              // Switch charging power on
         current[index] = mA;
-        ch_pid[index].init();
+        load_time[index] = millis();
+        cal_acc[index] = cal_cnt[index] = 0;
+        adc.sync(current_pin[index]);                       // Drop the current samples of the previous set point
+        ch_pid[index].schedule(mA);                         // Select the PID coefficients of the current band
+        pwm.dithering(index, mA < PWM_DITHER_CURRENT);      // Fine duty resolution for the low currents
+        uint16_t d = ff[index].duty(mA, voltage[index]);    // The learned duty for this current, 0 if unknown
+        if (d > 0 || !charging) {
+            ch_pid[index].resetPID(d);
+            applied[index] = d;
+            pwm.duty(index, d);                             // Apply the learned voltage to LM317 at once
+        }                                                   // Otherwise keep the PID power: bumpless transfer to the new set current
+        startSettling(index);
     } else {
-        mode[index] = MODE_STOP;
+        setMode(index, MODE_STOP);
         digitalWrite(discharge_pin[index], LOW);            // Make sure stop discharging
         digitalWrite(enable_pin[index], LOW);               // Switch charging power off
+        applied[index] = 0;
+        pwm.dithering(index, false);
+        pwm.duty(index, 0);                                 // No voltage to LM317
     }
-    pwm.duty(index, 0);                                     // No voltage to LM317 yet
 }
 
 void TWCHARGER::pauseCharging(uint8_t index, bool on) {
     if (index >= 2) return;
+    closeWindow(index);
     if (!on) {
         if (mode[index] == MODE_PAUSE) {
-            mode[index] = MODE_CHARGE;
+            setMode(index, MODE_CHARGE);
             digitalWrite(enable_pin[index], HIGH);
+            adc.syncRestart(current_pin[index]);            // Drop the current samples made in the pause
+            startSettling(index, true);                     // Measure the current recovery time after the pause
         }
     } else {
         if (mode[index] == MODE_CHARGE) {
-            mode[index] = MODE_PAUSE;
+            setMode(index, MODE_PAUSE);
             digitalWrite(enable_pin[index], LOW);
         }
     }
 }
 
 void TWCHARGER::keepCurrent(uint8_t index) {
+    uint32_t now_us = micros();
+    uint32_t dt = now_us - count_us[index];                 // The time since the previous step of the channel
+    count_us[index] = now_us;
+    if (mode[index] == MODE_CHARGE && pulsing(index))
+        return;                                             // The discharge pulse, the charging power is off
+    int16_t actual_current = 0;
+    if (mode[index] == MODE_CHARGE)
+        actual_current = syncCurrent(index);                // Low noise current, sampled at the same PWM phase
+    if (watchSlot(index, actual_current)) return;           // The battery removed, the channel is off
     if (mode[index] == MODE_CHARGE) {
-        int16_t actual_current = mA(index);
-        charge_ctr[index] += actual_current;                // Count applied current
-        if (charge_ctr[index] >= power_mAh) {               // Charged at least by 1 mAh
-            ++charge_mAh[index];
-            charge_ctr[index] -= power_mAh;
+        charge_cnt[index].count(actual_current, dt, loadMV(index));
+        if (tune_ch != index || tune_status[index] != TUNE_RELAY) { // The relay experiment drives the current out of tolerance
+            checkSettling(index, actual_current);
+            if (steady(index, actual_current))              // Learn the duty that produced the current
+                ff[index].learn(applied[index], actual_current, voltage[index]);
+        }
+        int32_t pwr = ch_pid[index].reqPower(current[index], actual_current); // Already limited by the PWM saturation limits
+        uint8_t frac = ch_pid[index].fraction();
+        if (tune_ch == index) {
+            pwr = autotuneStep(index, actual_current, pwr);
+            if (tune_status[index] != TUNE_SETTLE) frac = 0; // The relay applies the integer duty
         }
-        int32_t pwr = ch_pid[index].reqPower(current[index], actual_current);
-        pwr = constrain(pwr, 0, 7000);
-        pwm.duty(index, pwr);                               // Apply voltage to LM317
+        applied[index] = pwr;
+        pwm.duty(index, pwr, frac);                         // Apply voltage to LM317, dithered in low current mode
     } else if (mode[index] == MODE_DISCHARGE) {
-        dische_ctr[index] += mA(index);                     // Count discharge current
-        if (dische_ctr[index] >= power_mAh) {               // Charged at least by 1 mAh
-            ++dische_mAh[index];
-            dische_ctr[index] -= power_mAh;
+        dische_cnt[index].count(mA(index), dt, loadMV(index));
+    }
+}
+
+/*
+ * Called every control step of the channel.
+ * When the slot is not charged, the latest background reading of the voltage pin is checked: the battery is inserted
+ * when the voltage is greater than BATT_DETECT_VOLTAGE and removed when the voltage is lower for removal_steps steps.
+ * While charging the battery voltage pin shows the LM317 output, so the removed battery is recognized by the current:
+ * the charging power is at least BATT_DETECT_POWER (see detect()) but the current through the charge resistor
+ * is not greater than BATT_DETECT_CURRENT mV, or a half of the set current when it is lower (the keep current).
+ * The removal is confirmed in removal_steps (half a second), so the current rising after the pause is not a removal.
+ * The limit: the set current of a few mA is close to the ADC step, and the PID winds the power up
+ * to BATT_DETECT_POWER slowly at the low current, so the removed battery is recognized with a delay of seconds.
+ * The removed battery slot is switched off at once, and the event is posted to the main loop.
+ */
+bool TWCHARGER::watchSlot(uint8_t index, int16_t actual_current) {
+    if (tune_ch == index || det_state[index] == DETECT_LOAD || det_state[index] == DETECT_PROBE)
+        return false;                                       // The load is managed by the autotune or the battery detection
+    uint8_t mask = 1 << index;
+    bool gone = false;
+    if (mode[index] == MODE_CHARGE) {
+        int16_t lost = milliAmps(BATT_DETECT_CURRENT, (index==0)?TWCH_CHARGE_RES_A:TWCH_CHARGE_RES_B);
+        if (lost > current[index] / 2)                      // Scale the threshold to the low set current
+            lost = current[index] / 2;
+        gone = current[index] > 0 && applied[index] >= BATT_DETECT_POWER && actual_current <= lost;
+    } else {
+        if (!adc.ready(voltage_pin[index])) return false;
+        if (adc.latestMilliVolts(voltage_pin[index]) > BATT_DETECT_VOLTAGE) {
+            if (!(present & mask)) {                        // New battery inserted
+                present |= mask;
+                slot_event[index] = SLOT_INSERTED;
+                det_next[index]   = 0;                      // Check the battery at once
+            }
+        } else {
+            gone = true;
         }
     }
+    if (!gone || !(present & mask)) {
+        gone_steps[index] = 0;
+        return false;
+    }
+    if (++gone_steps[index] < removal_steps) return false;
+    gone_steps[index] = 0;
+    present &= ~mask;
+    setChargeCurrent(index, 0);                             // Switch off PWM, the charging power & discharge at once
+    slot_event[index] = SLOT_REMOVED;
+    return true;
 }
 
-bool TWCHARGER::isBatteryConnected(uint8_t index, uint8_t iteration) {
-    bool status = false;
-    if (index < 2 && iteration < 20 && mode[index] == MODE_STOP) {
-        digitalWrite(discharge_pin[index], LOW);            // Make sure stop discharging
-        digitalWrite(enable_pin[index], HIGH);              // Switch charging power on
-        uint16_t power = map(iteration, 0, 19, BATT_DETECT_POWER, MAX_BATT_DETECT_POWER);
-        pwm.duty(index, power);
-        delay(100);
-        uint16_t mV = milliVolts(current_pin[index]);
-        pwm.off();
-        status = (mV > BATT_DETECT_CURRENT);
-        digitalWrite(enable_pin[index], LOW);
+uint8_t TWCHARGER::slotEvent(uint8_t index) {
+    if (index >= 2) return SLOT_NONE;
+    uint8_t e = slot_event[index];
+    slot_event[index] = SLOT_NONE;
+    return e;
+}
+
+/*
+ * Start the relay experiment on the channel. The battery should be connected.
+ * The channel is charged by the current until it settles by PID, then the relay experiment starts.
+ * When the experiment is complete, the PID coefficients of the channel are updated and the channel stops.
+ */
+bool TWCHARGER::startAutotune(uint8_t index, uint16_t mA) {
+    if (index >= 2 || tune_ch < 2 || mA == 0) return false;
+    if (det_state[index] == DETECT_PROBE) stopProbe(index);
+    det_state[index] = DETECT_OFF;                          // Restart the battery detection when the autotune is over
+    setChargeCurrent(index, mA);
+    tune_ch             = index;
+    tune_status[index]  = TUNE_SETTLE;
+    tune_start          = millis();
+    return true;
+}
+
+uint8_t TWCHARGER::autotuneStatus(uint8_t index) {
+    if (index >= 2) return TUNE_OFF;
+    if (tune_ch == index && millis() - tune_start > tune_timeout) { // The current has not settled or does not oscillate
+        tune_ch = 2;
+        tune_status[index] = TUNE_FAIL;
+        setChargeCurrent(index, 0);
     }
-    return status;
+    return tune_status[index];
 }
 
-void TWCHARGER::clearSensors(void) {
-    for (uint8_t i = 0; i < 8; ++i) {
-        ds1820b_addr[0][i] = ds1820b_addr[1][i] = 0;
+// Called by keepCurrent() on the tuned channel. Returns the PWM duty to be applied
+uint16_t TWCHARGER::autotuneStep(uint8_t index, int16_t actual_current, uint16_t pwr) {
+    if (tune_status[index] == TUNE_SETTLE) {
+        if (settle_start[index] == 0) {                     // The current settled by PID, start the relay
+            tuner.start(applied[index], current[index]);
+            tune_status[index] = TUNE_RELAY;
+        }
+        return pwr;
+    }
+    pwr = tuner.step(actual_current);
+    if (tuner.complete()) {
+        int Kp = 0, Ki = 0;
+        if (tuner.calculate(ch_pid[index].denominator(), Kp, Ki)) {
+            ch_pid[index].changePID(1, Kp);
+            ch_pid[index].changePID(2, Ki);
+            tune_status[index] = TUNE_DONE;
+        } else {
+            tune_status[index] = TUNE_FAIL;
+        }
+        tune_ch = 2;
+        setChargeCurrent(index, 0);
+        pwr = 0;
+    }
+    return pwr;
+}
+
+/*
+ * Called from TIMER1 overflow interrupt handler.
+ * Just mark the channel as requested the control step, the step itself is performed by control()
+ */
+void TWCHARGER::controlTick(uint8_t index) {
+    uint8_t mask = 1 << index;
+    if (control_due & mask) {                               // The previous step has not been performed yet
+        if (overruns < 0xffff) ++overruns;
+    }
+    control_due |= mask;
+}
+
+/*
+ * The charging current control task. Called from the main loop and from yield() while delay() waiting.
+ * The step uses the current value sampled by the background ADC sampler, so it never waits for the ADC.
+ * The worst-case execution time of the step is registered.
+ */
+void TWCHARGER::control(void) {
+    for (uint8_t i = 0; i < 2; ++i) {
+        uint8_t mask = 1 << i;
+        if (!(control_due & mask)) continue;
+        uint8_t sreg = SREG;
+        cli();
+        control_due &= ~mask;
+        SREG = sreg;
+        uint32_t start = micros();
+        keepCurrent(i);
+        uint32_t t = micros() - start;
+        if (t > wcet) wcet = t;
+    }
+}
+
+void TWCHARGER::startSettling(uint8_t index, bool recovery) {
+    if (settle_start[index] && settle_fail[index] < 255)    // The current has not been settled since previous start
+        ++settle_fail[index];
+    settle_start[index] = millis();
+    if (settle_start[index] == 0) settle_start[index] = 1;
+    settle_steps[index] = 0;
+    uint8_t mask = 1 << index;
+    if (recovery)
+        recovering |= mask;
+    else
+        recovering &= ~mask;
+}
+
+/*
+ * Called every control step while charging.
+ * The current is settled when it stays within the tolerance (see steady()) for settled_steps steps.
+ * The settling time is the time from the set point change to the first step in the tolerance.
+ * When the settled current gets out of the tolerance for settled_steps steps (the battery was disconnected or
+ * the current was disturbed), the recovery time is measured from the first step out of tolerance.
+ * The recovery after the pause is measured the same way.
+ */
+void TWCHARGER::checkSettling(uint8_t index, int16_t actual_current) {
+    uint32_t steps_ms = (settled_steps - 1) * (1000 / CONTROL_RATE);
+    if (settle_start[index] == 0) {                         // Already settled, check the current is still in the tolerance
+        if (steady(index, actual_current)) {
+            settle_steps[index] = 0;
+        } else if (++settle_steps[index] >= settled_steps) {
+            startSettling(index, true);
+            settle_start[index] -= steps_ms;                // The current got out of the tolerance some steps ago
+            if (settle_start[index] == 0) settle_start[index] = 1;
+        }
+        return;
+    }
+    if (!steady(index, actual_current)) {
+        settle_steps[index] = 0;
+        return;
     }
+    if (++settle_steps[index] < settled_steps) return;
+    uint32_t t = millis() - settle_start[index];
+    t -= steps_ms;                                          // The current got in the tolerance some steps ago
+    if (t > 0xffff) t = 0xffff;
+    if (recovering & (1 << index)) {
+        recover_last[index] = t;
+        if (t > recover_max[index]) recover_max[index] = t;
+    } else {
+        settle_last[index] = t;
+        if (t > settle_max[index]) settle_max[index] = t;
+    }
+    settle_start[index] = 0;
+    settle_steps[index] = 0;
+}
+
+// The charging current is in the tolerance: 5% of the set current + 2 mA
+bool TWCHARGER::steady(uint8_t index, int16_t actual_current) {
+    int16_t tolerance = current[index] / 20 + 2;
+    return abs(actual_current - (int16_t)current[index]) <= tolerance;
 }
 
-uint32_t TWCHARGER::milliVolts(uint8_t pin) {
-    uint32_t v = 0;
+void TWCHARGER::resetSettling(uint8_t index) {
+    if (index >= 2) return;
+    settle_last[index]  = 0;
+    settle_max[index]   = 0;
+    settle_fail[index]  = 0;
+    settle_start[index] = 0;
+    recover_last[index] = 0;
+    recover_max[index]  = 0;
+}
+
+void TWCHARGER::startDetect(uint8_t index) {
+    if (index >= 2) return;
+    det_start[index]    = 0;
+    det_mV[index]       = 0;
+    det_probe[index]    = 0;
+    detectState(index, DETECT_VOLTAGE, 0);
+}
+
+void TWCHARGER::detectState(uint8_t index, uint8_t state, uint16_t wait) {
+    det_state[index]    = state;
+    det_sample[index]   = false;
+    det_next[index]     = millis() + wait;
+}
+
+void TWCHARGER::stopProbe(uint8_t index) {
+    digitalWrite(enable_pin[index], LOW);
+    pwm.duty(index, 0);
+}
+
+/*
+ * The battery detection state machine, never waits. Should be called periodically while the slot is idle.
+ * DETECT_VOLTAGE: wait the battery voltage in the slot is greater than BATT_DETECT_VOLTAGE and stable.
+ * DETECT_LOAD:    discharge the battery and check the discharge current is at least MIN_DISCHARGE_CURRENT.
+ * DETECT_PROBE:   apply the charging power (detect_probes steps) and check the current is greater than BATT_DETECT_CURRENT.
+ * Every state changes the load first, waits detect_settle ms, restarts the sampler readings of the pin
+ * and waits the fresh reading from the background sampler.
+ */
+uint8_t TWCHARGER::detect(uint8_t index) {
+    if (index >= 2) return DETECT_OFF;
+    if (det_state[index] == DETECT_OFF) startDetect(index);
+    uint32_t n = millis();
+    if (det_state[index] == DETECT_FOUND || n < det_next[index]) return det_state[index];
+    uint8_t pin = (det_state[index] == DETECT_PROBE)?current_pin[index]:voltage_pin[index];
+    if (!det_sample[index]) {                               // The load settled, collect the fresh readings
+        adc.restart(pin);
+        det_sample[index] = true;
+        return det_state[index];
+    }
+    if (!adc.ready(pin)) return det_state[index];
+    switch (det_state[index]) {
+        case DETECT_VOLTAGE:
+        {
+            uint16_t mV = adc.milliVolts(pin);
+            if (mV <= BATT_DETECT_VOLTAGE) {                // Empty slot
+                det_start[index] = 0;
+                det_mV[index]    = 0;
+                detectState(index, DETECT_VOLTAGE, detect_poll);
+                break;
+            }
+            if (det_start[index] == 0) det_start[index] = n;
+            if (abs((int16_t)mV - (int16_t)det_mV[index]) > 30) { // Wait the battery voltage is stable
+                det_mV[index] = mV;
+                detectState(index, DETECT_VOLTAGE, 0);
+                break;
+            }
+            storeVoltage(index);
+            discharge(index, true);                         // Try to discharge the battery
+            detectState(index, DETECT_LOAD, detect_settle);
+            break;
+        }
+        case DETECT_LOAD:
+            if (mA(index) >= MIN_DISCHARGE_CURRENT) {       // The discharge current through the battery
+                discharge(index, false);
+                detectState(index, DETECT_FOUND, 0);
+                break;
+            }
+            discharge(index, false);
+            det_probe[index] = 0;
+            digitalWrite(enable_pin[index], HIGH);          // Switch charging power on, the channel mode is MODE_STOP
+            pwm.duty(index, BATT_DETECT_POWER);
+            detectState(index, DETECT_PROBE, detect_settle);
+            break;
+        case DETECT_PROBE:
+            if (adc.milliVolts(pin) > BATT_DETECT_CURRENT) { // The charging current detected
+                stopProbe(index);
+                detectState(index, DETECT_FOUND, 0);
+                break;
+            }
+            if (++det_probe[index] < detect_probes) {      // Increase the charging power
+                uint16_t power = map(det_probe[index], 0, detect_probes-1, BATT_DETECT_POWER, MAX_BATT_DETECT_POWER);
+                pwm.duty(index, power);
+                detectState(index, DETECT_PROBE, detect_settle);
+                break;
+            }
+            stopProbe(index);                               // No battery detected, try again later
+            det_start[index] = 0;
+            det_mV[index]    = 0;
+            detectState(index, DETECT_VOLTAGE, detect_retry);
+            break;
+        default:
+            break;
+    }
+    if (det_state[index] == DETECT_FOUND) {
+        uint32_t t = n - det_start[index];
+        if (t > 0xffff) t = 0xffff;
+        det_time[index] = t;
+    }
+    return det_state[index];
+}
+
+void TWCHARGER::clearSensors(void) {
     for (uint8_t i = 0; i < 8; ++i) {
-        v += analogRead(pin);
-        delay(20);
-    }
-    v += 4;
-    v >>= 3;
-    v *= AREF_MV;
-    v += 1023/2;                                            // Round the result
-    v /= 1023;
-    return v;
+        ds1820b_addr[0][i] = ds1820b_addr[1][i] = 0;
+    }
 }
 
 // change two sensors address
@@ -4,12 +4,29 @@
 #include "config.h"
 #include "types.h"
 #include "stat.h"
+#include "sampler.h"
 #include <OneWire.h>
 #include <Time.h>
 #include <TimeLib.h>
 
+#define PWM_FREQUENCY   (500)                               // TIMER1 overflow frequency, Hz
+#define CONTROL_PERIOD  (PWM_FREQUENCY/CONTROL_RATE)        // The control period of every channel in TIMER1 overflows
+#define PWM_MAX_DUTY    (7000)                              // The maximum PWM duty applied to LM317
+#define PWM_FRAC_BITS   (4)                                 // The fractional bits of the dithered PWM duty
+#define PID_KP          (128*8)                             // The default PID proportional coefficient
+#define PID_KI          ((50*8*4 + CONTROL_RATE/2) / CONTROL_RATE) // The default PID integral coefficient
+#define TWCH_RING_MS    (250)                               // The sampler ring buffer of the pin is refilled by the fresh readings, ms
+#define TWCH_CAL_STEPS  (1024)                              // The synchronized current readings averaged for the calibration
+
+#if CONTROL_RATE < 50 || CONTROL_RATE > 100
+#error "CONTROL_RATE should be in the interval 50-100 Hz"
+#endif
+#if PWM_FREQUENCY % CONTROL_RATE
+#error "CONTROL_RATE should divide PWM_FREQUENCY (500 Hz): 50, 100 Hz"
+#endif
+
 typedef enum {
-    MODE_STOP = 0, MODE_CHARGE, MODE_PAUSE, MODE_DISCHARGE, MODE_WAS_CHARGE
+    MODE_STOP = 0, MODE_CHARGE, MODE_PAUSE, MODE_DISCHARGE, MODE_WAS_CHARGE, MODE_WAS_DISCHARGE
 } TWCH_MODE;
 
 /*  The PID algorithm 
@@ -17,35 +34,155 @@ typedef enum {
  *  Where Xs - is the preset current, Xn - the current on n-iteration step
  *  In this program the interactive formula is used:
  *    Un = Un-1 + Kp*(Xn-1 - Xn) + Ki*(Xs - Xn)
- *  With the first step:
- *  U0 = Kp*(Xs - X0) + Ki*(Xs - X0); Xn-1 = Xn;
+ *  The first step after reset starts from the seeded power U-1 (see resetPID()), the previous current is unknown:
+ *  U0 = U-1 + Ki*(Xs - X0)
+ *  The coefficients were tuned for 4 Hz control rate and the denominator 512.
+ *  The proportional term of the interactive formula does not depend on the control rate,
+ *  the integral coefficient is scaled to CONTROL_RATE. The denominator is 4096 to keep the coefficients accurate.
+ *  The plant gain depends on the charging current, so the coefficients are scheduled by the set current band:
+ *  the low currents (keep, precharge) get more integral gain to not crawl, the fast charge gets less gain
+ *  to not overshoot. Because the power is accumulated by the incremental formula, the coefficients can be
+ *  switched between the steps without the output bump.
+ *  The output is limited by the PWM saturation limits (see limits()). In the incremental formula the power
+ *  accumulator is the integrator state, so the back-calculation anti-windup with the tracking time of one control
+ *  step returns the accumulator to the saturation limit: the power never winds up beyond the applied output
+ *  and the controller responds at once when the current returns (after a pause or a disconnected battery).
  */
 class PID {
     public:
         PID(void)                                           { }
         void        init(uint8_t denominator_p = 11);
-        void        resetPID(void);                         // reset PID algorithm history parameters
+        void        limits(uint16_t low, uint16_t high);    // The output saturation limits, PWM duty
+        void        resetPID(uint16_t duty = 0);            // reset PID algorithm history parameters, start from the PWM duty if known
         int32_t     reqPower(int16_t current_set, int16_t actual_current);
-        int         changePID(uint8_t p, int k);            // set or get (if parameter < 0) PID parameter
+        void        schedule(uint16_t current_set);         // Select the coefficients of the set current band
+        int         changePID(uint8_t p, int k, uint8_t band = PID_BANDS); // set or get (if parameter < 0) PID parameter of the band (active by default)
+        uint8_t     band(void)                              { return active; }
+        uint8_t     denominator(void)                       { return denominator_p; }
+        bool        saturated(void)                         { return sat; }
+        uint8_t     fraction(void)                          { return frac; } // The fractional part of the last output, PWM_FRAC_BITS bits
     private:
-        bool        reached         = false;                // The required current value has reached
-        int16_t     curr_h0         = -1;                   // previously measured current
-        int16_t     curr_h1         = -1;
-        int32_t     i_summ          = 0;                    // Ki summary multiplied by denominator
+        void        backCalculate(void);                    // Anti-windup, track the power accumulator to the saturation limits
+        int16_t     curr_h1         = -1;                   // previously measured current, -1 if unknown
         int32_t     power           = 0;                    // The power iterative multiplied by denominator
-        int32_t     previous_power  = 0;                    // The power that was applied before multiplied by denominator
-        int32_t     Kp              = 128;                  // The PID proportional coefficient multiplied by denominator.
-        int32_t     Ki              = 50;                  // The PID integral coefficient multiplied by denominator.
-        int16_t     denominator_p   = 9;                    // The common coefficient denominator power of 2 (9 means 512)
+        uint16_t    out_min         = 0;                    // The output saturation limits, PWM duty
+        uint16_t    out_max         = PWM_MAX_DUTY;
+        bool        sat             = false;                // The output has been saturated by the last step
+        uint8_t     frac            = 0;                    // The fractional part of the last output
+        int32_t     Kp[PID_BANDS]   = {PID_KP, PID_KP, PID_KP*3/4};   // The PID proportional coefficients multiplied by denominator.
+        int32_t     Ki[PID_BANDS]   = {PID_KI*2, PID_KI, PID_KI/2};   // The PID integral coefficients multiplied by denominator.
+        uint8_t     active          = 1;                    // The active current band
+        const uint16_t band_edge[PID_BANDS-1] = {64, 320};  // The current band upper edges, mA
+        int16_t     denominator_p   = 12;                   // The common coefficient denominator power of 2 (12 means 4096)
+};
+
+/*
+ * Relay feedback experiment to tune the PID coefficients (Astrom-Hagglund).
+ * The PWM duty toggles between base+d and base-d when the current crosses the set value (with hysteresis eps).
+ * The current oscillates with amplitude a and period Tu (in control steps).
+ * The ultimate gain is Ku = 4*d / (pi * sqrt(a^2 - eps^2)).
+ * The PI coefficients are calculated by Ziegler-Nichols rule: Kp = 0.45*Ku, Ki = 1.2*Kp/Tu (per control step)
+ * and multiplied by PID denominator.
+ * The first tune_skip oscillations are skipped, then tune_cycles oscillations are averaged.
+ */
+class AUTOTUNE {
+    public:
+        AUTOTUNE(void)                                      { }
+        void        start(uint16_t base_duty, uint16_t current_set);
+        uint16_t    step(int16_t actual_current);           // The relay step, returns the PWM duty to be applied
+        bool        complete(void)                          { return cycles >= tune_skip + tune_cycles; }
+        bool        calculate(uint8_t denominator_p, int &Kp, int &Ki); // Calculate the coefficients, false if failed
+    private:
+        uint16_t    base            = 0;                    // The PWM duty of the steady current
+        uint16_t    d               = 0;                    // The relay amplitude, PWM duty
+        int16_t     set             = 0;                    // The set current, mA
+        int16_t     eps             = 0;                    // The relay hysteresis, mA
+        bool        high            = true;                 // The relay output is base+d
+        int16_t     c_max           = 0;                    // The maximum current in this oscillation
+        int16_t     c_min           = 0;                    // The minimum current in this oscillation
+        uint16_t    steps           = 0;                    // The control steps in this oscillation
+        uint8_t     cycles          = 0;                    // The number of complete oscillations
+        uint32_t    summ_pp         = 0;                    // The summ of peak-to-peak amplitudes, mA
+        uint32_t    summ_period     = 0;                    // The summ of oscillation periods, control steps
+        const uint8_t   tune_skip   = 2;                    // The oscillations to be skipped
+        const uint8_t   tune_cycles = 4;                    // The oscillations to be averaged
+};
+
+/*
+ * The feed-forward table of PWM duty required to get the charging current.
+ * The required duty depends on the charging current and on the battery voltage, so the table
+ * is organized by FF_VOLT_BINS battery voltage rows and FF_CURR_BINS charging current bins.
+ * Every learned cell keeps the exponential average of the PWM duty and the current it produced.
+ * The cell is updated when the charging current is steady.
+ * The duty for the current is interpolated between learned cells of the battery voltage row,
+ * or extrapolated by two nearest cells. If the row is empty, the nearest learned row is used.
+ */
+#define FF_CURR_BINS    (5)
+#define FF_VOLT_BINS    (3)
+
+class FEEDFORWARD {
+    public:
+        FEEDFORWARD(void)                                   { }
+        void        init(void);
+        void        learn(uint16_t duty, uint16_t mA, uint16_t mV);
+        uint16_t    duty(uint16_t mA, uint16_t mV);         // The PWM duty for the current, 0 if unknown
+    private:
+        uint8_t     currentBin(uint16_t mA);
+        uint8_t     voltageBin(uint16_t mV);
+        uint16_t    rowDuty(uint8_t row, uint16_t mA);
+        uint16_t    f_duty[FF_VOLT_BINS][FF_CURR_BINS];     // The learned duty, 0 if the cell is empty
+        uint16_t    f_mA[FF_VOLT_BINS][FF_CURR_BINS];       // The current the duty produced
+        const uint16_t  curr_edge[FF_CURR_BINS-1] = {16, 48, 128, 320}; // The current bin upper edges, mA
+        const uint16_t  volt_edge[FF_VOLT_BINS-1] = {1200, 1400};       // The voltage row upper edges, mV
+        const uint8_t   avg_shift   = 3;                    // The exponential average factor power of 2 (3 means 1/8)
+};
+
+//------------------------- The coulomb counter of the (dis)charging channel ---------------------------------
+/*
+ * The current is integrated over the elapsed time measured by micros(), so the missed or delayed control steps
+ * do not distort the counter. The charge is counted in uAh, 1 uAh = COUL_MA_US mA*us. The energy is counted in uWh,
+ * every counted uAh adds the battery voltage (mV) nWh. The remainders are kept between the steps.
+ * The counters are updated in the main loop and can be read at any time.
+ */
+#define COUL_MA_US      (3600000UL)                         // mA*us in 1 uAh
+#define COUL_MAX_STEP   (65000UL)                           // The longest integrated interval, us. Keeps mA*us in 32 bits
+
+class COULOMB {
+    public:
+        COULOMB(void)                                       { }
+        void        reset(void);
+        void        count(uint16_t mA, uint32_t us, uint16_t mV);
+        uint32_t    uAh(void);                              // The counted charge, uAh
+        uint32_t    uWh(void);                              // The counted energy, uWh
+    private:
+        volatile uint32_t   charge  = 0;                    // uAh
+        volatile uint32_t   energy  = 0;                    // uWh
+        uint32_t            q_rem   = 0;                    // The charge remainder, mA*us
+        uint16_t            e_rem   = 0;                    // The energy remainder, nWh
 };
 
 //------------------------- 16-bits timer TIM1 generates PWM signals on pins D9 & D10 -------------------------
+/*
+ * In the dithering mode the duty has PWM_FRAC_BITS fractional bits. The first-order sigma-delta modulator,
+ * updated every PWM period by TIMER1 overflow interrupt, adds one step to the integer duty so that
+ * the average duty over 2^PWM_FRAC_BITS periods equals the fractional value.
+ * The LM317 adjustment filter and the synchronized current sampling average the dithering out.
+ */
 class LongPWM {
     public:
         LongPWM()                                           { }
         void        init(void);
-        void        duty(uint8_t index, uint16_t d);
-        void        off(void)                               { OCR1A = OCR1B = 0; PORTB &= ~0b00000110; }
+        void        duty(uint8_t index, uint16_t d, uint8_t fraction = 0);
+        void        dithering(uint8_t index, bool on);      // Enable or disable the dithering mode of the channel
+        void        dither(void);                           // Called from TIMER1 overflow interrupt handler
+        void        off(void);
+        uint16_t    minDuty(void)                           { return 0; }
+        uint16_t    maxDuty(void)                           { return PWM_MAX_DUTY; }
+    private:
+        volatile uint16_t   base[2]     = {0};              // The integer duty of the dithered channel
+        volatile uint8_t    frac[2]     = {0};              // The fractional duty of the dithered channel
+        uint8_t             acc[2]      = {0};              // The sigma-delta accumulator
+        volatile uint8_t    dith        = 0;                // Bitmap of the channels in dithering mode
 };
 
 class TWCHARGER {
@@ -56,28 +193,82 @@ class TWCHARGER {
         bool        setSensorAddress(uint8_t index, const uint8_t addr[8]);
         bool        getSensorAddress(uint8_t index, uint8_t addr[8]);
         int16_t     temperature(uint8_t index);             // The battery sensor temperature, 1/10 of Celsius
-        uint16_t    mV(uint8_t index);                      // cached battery voltage, updated in expiration_period
+        bool        updateTemperature(void);                // Manage the sensors conversion, true when new values published
+        uint32_t    temperatureTime(void)                   { return temp_time; }
+        uint16_t    mV(uint8_t index);                      // The battery voltage, never suspends the other channel
+        uint16_t    fineMV(uint8_t index);                  // The battery voltage, mV with TWCH_MV_FRAC fractional bits
+        uint8_t     voltageBits(uint8_t index)              { return (index < 2)?voltage_bits[index]:0; } // The effective resolution of the voltage
+        void        updateVoltage(void);                    // Manage the voltage measurement windows of the channels
+        bool        quietWindow(void)                       { return measuring < 2 && settled; } // The battery voltage is being sampled in the window
+        void        sleepIdle(void);                        // Halt the CPU till the next interrupt, the timers & ADC keep running
         uint16_t    mA(uint8_t index);
+        void        calibrate(uint8_t index, uint16_t v_offset, uint16_t c_offset, uint16_t v_gain, uint16_t c_gain, uint16_t d_gain);
+        uint16_t    calReading(uint8_t index, uint8_t point);   // The sampler reading of the calibration point, see tCalPoint
+        bool        calSteady(uint8_t index);               // The sampler readings of the channel are taken under the current load only
+        uint16_t    calGain(uint8_t index, uint8_t point, uint16_t reading, uint16_t offset, uint16_t value); // The gain to convert the reading to the value
         void        discharge(uint8_t index, bool on);
-        void        pulseDischarge(uint8_t index, uint16_t ms);
+        void        pulseDischarge(uint8_t index, uint16_t ms, uint16_t rest_ms = 0); // Start the discharge pulse and rest, up to 510 ms, does not wait for the end
+        void        pulseTrain(uint8_t index, uint16_t charge_ms, uint16_t burp_ms = 0, uint16_t rest_ms = 0); // Reflex charging pulses, 0 to stop
+        bool        pulsing(uint8_t index)                  { return (pulse_req & (1 << index)) || pulse_left[index] > 0; }
+        void        pulseTick(void);                        // Manage the discharge pulses, called from TIMER1 overflow interrupt handler
         void        setChargeCurrent(uint8_t index, uint16_t mA);
         void        pauseCharging(uint8_t index, bool on = true);
-        void        keepCurrent(uint8_t index);             // Returns the current
-        bool        isBatteryConnected(uint8_t index, uint8_t iteration);  // Apply some to the battery and check current is greater than BATT_DETECT_CURRENT
-        int         changePID(uint8_t idx, uint8_t p, int k) { return ch_pid[idx].changePID(p, k); }
+        void        controlTick(uint8_t index);             // Request the charging current control step, called from TIMER1 ISR
+        void        control(void);                          // Perform the requested control steps in the main loop
+        uint16_t    controlWCET(void)                       { return wcet; }
+        uint16_t    controlOverruns(void)                   { return overruns; }
+        uint16_t    settleTime(uint8_t index)               { return (index < 2)?settle_last[index]:0; }
+        uint16_t    settleMax(uint8_t index)                { return (index < 2)?settle_max[index]:0; }
+        uint8_t     unsettled(uint8_t index)                { return (index < 2)?settle_fail[index]:0; }
+        uint16_t    recoverTime(uint8_t index)              { return (index < 2)?recover_last[index]:0; }
+        uint16_t    recoverMax(uint8_t index)               { return (index < 2)?recover_max[index]:0; }
+        void        resetSettling(uint8_t index);
+        void        startDetect(uint8_t index);             // Start the battery detection in the slot
+        uint8_t     detect(uint8_t index);                  // Manage the battery detection, returns tDetect status
+        uint16_t    detectTime(uint8_t index)               { return (index < 2)?det_time[index]:0; }
+        uint8_t     slotEvent(uint8_t index);               // Read and clear the slot event, see tSlotEvent
+        int         changePID(uint8_t idx, uint8_t p, int k, uint8_t band = PID_BANDS) { return ch_pid[idx].changePID(p, k, band); }
+        uint8_t     pidBand(uint8_t idx)                    { return ch_pid[idx].band(); }
+        bool        startAutotune(uint8_t index, uint16_t mA); // Start the PID autotune on the channel by the current
+        uint8_t     autotuneStatus(uint8_t index);          // See tTune
+        void        ditherPWM(void)                         { pwm.dither(); } // Called from TIMER1 overflow interrupt handler
+        bool        autotuneActive(uint8_t index)           { uint8_t s = autotuneStatus(index); return s == TUNE_SETTLE || s == TUNE_RELAY; }
         void        orderSensors(tSensorOrder order);
         bool        manageFan(void);
         void        fan(bool fan_on);
-        void        initChargeCounter(uint8_t index)        { if (index < 2) charge_ctr[index] = charge_mAh[index] = 0; }
-        void        initDischargeCounter(uint8_t index)     { if (index < 2) dische_ctr[index] = dische_mAh[index] = 0; }
-        uint16_t    charged(uint8_t index)                  { return (index < 2)?charge_mAh[index]:0; }
-        uint16_t    discharged(uint8_t index)               { return (index < 2)?dische_mAh[index]:0; }
-        uint8_t     getMode(uint8_t index)                  { if (index < 2) return mode[index]; else return 0; }
+        void        initChargeCounter(uint8_t index)        { if (index < 2) charge_cnt[index].reset(); }
+        void        initDischargeCounter(uint8_t index, bool full = false); // full: the charge counter holds the full charge preceding the discharge
+        uint16_t    charged(uint8_t index)                  { return chargedUAh(index) / 1000; }
+        uint16_t    discharged(uint8_t index)               { return dischargedUAh(index) / 1000; }
+        uint32_t    chargedUAh(uint8_t index)               { return (index < 2)?charge_cnt[index].uAh():0; }
+        uint32_t    dischargedUAh(uint8_t index)            { return (index < 2)?dische_cnt[index].uAh():0; }
+        uint16_t    chargedMWh(uint8_t index)               { return (index < 2)?charge_cnt[index].uWh()/1000:0; }
+        uint16_t    dischargedMWh(uint8_t index)            { return (index < 2)?dische_cnt[index].uWh()/1000:0; }
+        uint8_t     coulombEfficiency(uint8_t index);       // Discharged mAh to the preceding full charge mAh ratio, %. 0 if unknown
+        uint8_t     energyEfficiency(uint8_t index);        // Discharged mWh to the preceding full charge mWh ratio, %. 0 if unknown
+        uint8_t     getMode(uint8_t index);
         void        debugMode(bool on)                      { no_expiration = on; }
     private:
         void        clearSensors(void);
         void        changeSensors(uint8_t x, uint8_t y);
-        uint32_t    milliVolts(uint8_t pin);
+        bool        readSensor(uint8_t index, int16_t &t);  // Read the sensor scratchpad
+        void        setMode(uint8_t index, TWCH_MODE m);
+        void        closeWindow(uint8_t index);             // Resume the channel suspended for the voltage measurement
+        uint16_t    syncCurrent(uint8_t index);             // The charging current sampled synchronously with PWM
+        void        storeVoltage(uint8_t index);            // Save the decimated battery voltage reading to the cache
+        uint16_t    loadMV(uint8_t index);                  // The battery terminal voltage under the load, mV
+        uint16_t    milliAmps(uint32_t mV, uint32_t res);
+        uint16_t    convert(uint16_t reading, uint16_t offset, uint32_t k);
+        uint32_t    nominal(uint8_t index, uint8_t point);  // The nominal conversion multiplier of the calibration point
+        void        startSettling(uint8_t index, bool recovery = false); // Start to measure the settling (or recovery) time
+        bool        steady(uint8_t index, int16_t actual_current);
+        void        checkSettling(uint8_t index, int16_t actual_current);
+        uint16_t    autotuneStep(uint8_t index, int16_t actual_current, uint16_t pwr);
+        void        detectState(uint8_t index, uint8_t state, uint16_t wait); // Change the detection state, sample the pins after wait ms
+        void        stopProbe(uint8_t index);               // Switch off the detection load
+        void        stopPulse(uint8_t index);               // Cancel the discharge pulse of the channel
+        bool        watchSlot(uint8_t index, int16_t actual_current); // Fast battery insertion & removal check, true if the slot was switched off
+        void        keepCurrent(uint8_t index);             // Manage the charging current by PID, count (dis)charged mAh
         uint8_t     enable_pin[2];
         uint8_t     discharge_pin[2];                       // The pin used to activate discharge
         uint8_t     voltage_pin[2];                         // The pin to test the battery voltage
@@ -85,25 +276,83 @@ class TWCHARGER {
         uint8_t     fan_pin;                                // The pin to manage the Heat sink FAN
         uint8_t     ds1820b_addr[3][8];                     // Address of the temperature sensor on the One Wire bus
         OneWire     ds;                                     // One Wire protocol pin
-        time_t      voltage_update = 0;                     // When the voltage of both batteries should be updated
+        SAMPLER     adc;                                    // Background ADC sampler of the voltage & current pins
+        uint32_t    voltage_update[2] = {0};                // When the voltage measurement window of the channel should be opened (ms)
         uint16_t    voltage[2] = {0};                       // The battery voltage cache values
-        time_t      temp_update = 0;                        // When the temperature of both batteries should be updated
+        uint16_t    voltage_fine[2] = {0};                  // The battery voltage cache values, mV with TWCH_MV_FRAC fractional bits
+        uint16_t    cal_offset[2][2];                       // The voltage & current pin readings at zero input
+        uint32_t    cal_k[2][3];                            // Reading to fine mV, charge mA & discharge mA multipliers, 16 fractional bits
+        uint8_t     voltage_bits[2] = {0};                  // The effective resolution of the cached voltage, bits
+        uint32_t    mode_time[2]    = {0};                  // When the charger mode was changed (ms)
+        uint32_t    load_time[2]    = {0};                  // When the load of the channel was last changed or restored after the window (ms)
+        uint32_t    cal_acc[2]      = {0};                  // The sum of the synchronized current readings of the settled current
+        uint16_t    cal_cnt[2]      = {0};                  // The number of the summed synchronized current readings
+        uint32_t    window_start    = 0;                    // When the voltage measurement window was opened (ms)
+        uint8_t     measuring       = 2;                    // The channel suspended to measure the voltage, 2 - none
+        bool        settled         = false;                // The battery voltage settled in the measurement window
+        uint32_t    temp_update = 0;                        // When the temperature sensors state should be changed (ms)
+        uint32_t    temp_time   = 0;                        // When the temperature cache was published (ms)
+        bool        converting  = false;                    // The temperature conversion is in progress
         int16_t     temp[3] = {0};                          // The battery temperature cache values  
         TWCH_MODE   mode[2] = {MODE_STOP};                  // Charger mode
         uint16_t    current[2];                             // The preset charging current
         PID         ch_pid[2];
+        FEEDFORWARD ff[2];                                  // The learned PWM duty per channel
+        uint16_t    applied[2]      = {0};                  // The PWM duty applied by the last control step
+        AUTOTUNE    tuner;                                  // The relay experiment, one channel at a time
+        uint8_t     tune_ch         = 2;                    // The channel being tuned, 2 if none
+        uint8_t     tune_status[2]  = {TUNE_OFF, TUNE_OFF};
+        uint32_t    tune_start      = 0;                    // When the autotune started, ms
+        uint8_t     det_state[2]    = {DETECT_OFF, DETECT_OFF}; // The battery detection state
+        bool        det_sample[2]   = {false, false};       // The pins are sampled in this detection state
+        uint8_t     det_probe[2]    = {0};                  // The charging probe iteration
+        uint16_t    det_mV[2]       = {0};                  // The previous battery voltage reading
+        uint32_t    det_next[2]     = {0};                  // When to manage the detection state next time (ms)
+        uint32_t    det_start[2]    = {0};                  // When the battery voltage appeared in the slot (ms)
+        uint16_t    det_time[2]     = {0};                  // The last detection time, from the voltage appeared till detected (ms)
+        uint8_t     present         = 0;                    // Bitmap of the slots with the battery
+        uint8_t     gone_steps[2]   = {0};                  // The number of sequential control steps the battery looks removed
+        uint8_t     slot_event[2]   = {SLOT_NONE, SLOT_NONE}; // The slot event to be read by the main loop
         LongPWM     pwm;
         uint16_t    hs_hot_temp     = HS_HOT_TEMP;          // Heat sink temperature when turn the FAN on
         bool        fan_on;                                 // Current fan status
         bool        no_expiration   = false;
-        volatile uint32_t charge_ctr[2]   = {0};            // charge power counter
-        volatile uint32_t dische_ctr[2]   = {0};            // discharge power counter
-        volatile uint32_t charge_mAh[2]   = {0};            // charged mAh
-        volatile uint32_t dische_mAh[2]   = {0};            // discharge mAh
-        const uint32_t voltage_expiration = 10;             // The battery voltage should be updated in this period (secs)
-        const uint32_t temp_expiration    = 27;             // The battery temperature should be updated in this period (secs)
+        volatile uint8_t  control_due     = 0;              // Bitmap of the channels requested the control step
+        volatile uint8_t  pulse_req       = 0;              // Bitmap of the channels requested the discharge pulse
+        volatile uint8_t  pulse_left[2]   = {0};            // The discharge pulse remaining time (PWM periods)
+        volatile uint8_t  pulse_rest[2]   = {0};            // The rest time at the end of the discharge pulse (PWM periods)
+        volatile uint16_t train_period[2] = {0};            // The reflex charge pulse length (PWM periods), 0 if no pulse train
+        volatile uint16_t train_cnt[2]    = {0};            // The remaining time of the reflex charge pulse (PWM periods)
+        uint8_t     train_burp[2]   = {0};                  // The reflex discharge pulse length (PWM periods)
+        uint8_t     train_rest[2]   = {0};                  // The reflex rest time after discharge pulse (PWM periods)
+        uint16_t    wcet            = 0;                    // The worst-case execution time of the control step, us
+        uint16_t    overruns        = 0;                    // The number of the control steps were requested before previous one complete
+        uint32_t    settle_start[2] = {0};                  // When the current started to settle (ms), 0 if settled
+        uint16_t    settle_last[2]  = {0};                  // The last current settling time (ms)
+        uint16_t    settle_max[2]   = {0};                  // The maximum current settling time in the phase (ms)
+        uint8_t     settle_fail[2]  = {0};                  // The number of times the current has not been settled
+        uint8_t     settle_steps[2] = {0};                  // The number of sequential control steps the current is in (out of) tolerance
+        uint8_t     recovering      = 0;                    // Bitmap of the channels recovering the current after pause or disturbance
+        uint16_t    recover_last[2] = {0};                  // The last current recovery time (ms)
+        uint16_t    recover_max[2]  = {0};                  // The maximum current recovery time in the phase (ms)
+        COULOMB     charge_cnt[2];                          // The charge counters
+        COULOMB     dische_cnt[2];                          // The discharge counters
+        uint32_t    full_uAh[2]     = {0};                  // The full charge preceding the discharge, uAh. 0 if unknown
+        uint32_t    full_uWh[2]     = {0};                  // The full charge preceding the discharge, uWh
+        uint32_t    count_us[2]     = {0};                  // The time of the previous control step of the channel, us
+        const uint32_t voltage_period     = 10000;          // The battery voltage should be measured in this period (ms)
+        const uint16_t settle_time        = 50;             // The battery voltage settle time after the load is off (ms)
+        const uint16_t idle_time          = 120;            // The idle channel voltage is read directly after this time (ms)
+        const uint32_t temp_period        = 5000;           // The battery temperature should be updated in this period (ms)
+        const uint16_t conversion_time    = 750;            // The maximum temperature conversion time of DS18B20 (ms)
         const uint8_t  avg_length         = 4;
-        const uint32_t power_mAh          = 14400;          // 3600 * 4;
+        const uint32_t tune_timeout       = 30000;          // The maximum autotune time (ms)
+        const uint16_t detect_poll        = 50;             // The empty slot voltage check period (ms)
+        const uint16_t detect_settle      = 20;             // The load settle time before sampling (ms)
+        const uint16_t detect_retry       = 1000;           // The detection retry period after the probe failed (ms)
+        const uint8_t  detect_probes      = 4;              // The number of charging probes from BATT_DETECT_POWER to MAX_BATT_DETECT_POWER
+        const uint8_t  removal_steps      = CONTROL_RATE/2; // The battery is removed when it looks removed for these control steps
+        const uint8_t  settled_steps      = 3;              // The current is settled when it is in tolerance for these steps
 };
 
 #endif